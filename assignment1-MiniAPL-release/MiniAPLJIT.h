@@ -5,6 +5,7 @@
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
 #include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
@@ -14,9 +15,14 @@
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Mangler.h"
 #include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
 #include <algorithm>
+#include <map>
 #include <memory>
 #include <string>
 #include <vector>
@@ -27,16 +33,88 @@ using namespace std;
 namespace llvm {
 namespace orc {
 
+// Stores the object files produced by the compile layer in a directory,
+// named after the identifier of the module they were compiled from. Callers
+// give modules an identifier that covers everything the object depends on,
+// so a module whose object is already on disk is never compiled again.
+class MiniAPLObjectCache : public ObjectCache {
+public:
+  MiniAPLObjectCache(const std::string &Dir) : CacheDir(Dir) {
+    sys::fs::create_directories(CacheDir);
+  }
+
+  // Loads the object for Key, if there is one, and holds on to it until the
+  // module with that identifier is compiled. Returns true on a hit; the
+  // module then needs no IR at all.
+  bool prefetch(const std::string &Key) {
+    auto Buffer = MemoryBuffer::getFile(objectPath(Key), -1, false);
+    if (!Buffer)
+      return false;
+    Prefetched[Key] = std::move(*Buffer);
+    return true;
+  }
+
+  std::unique_ptr<MemoryBuffer> getObject(const Module *M) override {
+    const std::string &Key = M->getModuleIdentifier();
+    auto P = Prefetched.find(Key);
+    if (P != Prefetched.end()) {
+      auto Buffer = std::move(P->second);
+      Prefetched.erase(P);
+      return Buffer;
+    }
+    auto Buffer = MemoryBuffer::getFile(objectPath(Key), -1, false);
+    if (!Buffer)
+      return nullptr;
+    return std::move(*Buffer);
+  }
+
+  void notifyObjectCompiled(const Module *M, MemoryBufferRef Obj) override {
+    // Write to a private file and rename it into place, so concurrent runs
+    // never read a partially written object.
+    int FD;
+    SmallString<128> TempPath;
+    if (sys::fs::createUniqueFile(objectPath(M->getModuleIdentifier()) + ".tmp-%%%%%%",
+                                  FD, TempPath))
+      return;
+    {
+      raw_fd_ostream Out(FD, true);
+      Out.write(Obj.getBufferStart(), Obj.getBufferSize());
+      if (Out.has_error()) {
+        Out.clear_error();
+        sys::fs::remove(TempPath);
+        return;
+      }
+    }
+    if (sys::fs::rename(TempPath, objectPath(M->getModuleIdentifier())))
+      sys::fs::remove(TempPath);
+  }
+
+private:
+  std::string objectPath(const std::string &Key) const {
+    SmallString<128> Path(CacheDir);
+    sys::path::append(Path, Key + ".o");
+    return Path.str();
+  }
+
+  std::string CacheDir;
+  std::map<std::string, std::unique_ptr<MemoryBuffer>> Prefetched;
+};
+
 class MiniAPLJIT {
 public:
   using ObjLayerT = RTDyldObjectLinkingLayer;
   using CompileLayerT = IRCompileLayer<ObjLayerT, SimpleCompiler>;
   using ModuleHandleT = CompileLayerT::ModuleHandleT;
 
-  MiniAPLJIT()
-      : TM(EngineBuilder().selectTarget()), DL(TM->createDataLayout()),
+  // Objects are looked up in and saved to Cache, if one is given.
+  MiniAPLJIT(ObjectCache *Cache = nullptr)
+      : TM(EngineBuilder()
+               .setMCPU(sys::getHostCPUName())
+               .setMAttrs(hostCPUFeatures())
+               .selectTarget()),
+        DL(TM->createDataLayout()),
         ObjectLayer([]() { return std::make_shared<SectionMemoryManager>(); }),
-        CompileLayer(ObjectLayer, SimpleCompiler(*TM)) {
+        CompileLayer(ObjectLayer, SimpleCompiler(*TM, Cache)) {
     llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
   }
 
@@ -69,6 +147,17 @@ public:
     return findMangledSymbol(mangle(Name));
   }
 
+  // Generate code for the CPU we are running on, so the vectorizers can use
+  // every SIMD extension it has.
+  static std::vector<std::string> hostCPUFeatures() {
+    StringMap<bool> Features;
+    std::vector<std::string> Attrs;
+    if (sys::getHostCPUFeatures(Features))
+      for (auto &F : Features)
+        Attrs.push_back((F.second ? "+" : "-") + F.first().str());
+    return Attrs;
+  }
+
 private:
   std::string mangle(const std::string &Name) {
     std::string MangledName;
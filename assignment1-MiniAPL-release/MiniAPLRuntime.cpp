@@ -0,0 +1,463 @@
+#include "MiniAPLRuntime.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+int32_t miniapl_elem_bytes(int32_t type) {
+  switch (type) {
+    case MINIAPL_I8: return 1;
+    case MINIAPL_I16: return 2;
+    case MINIAPL_I64: case MINIAPL_F64: return 8;
+    default: return 4;
+  }
+}
+
+// -------------------------------------------------
+// Array arena
+// -------------------------------------------------
+
+// Arrays are carved out of large anonymous mappings with a bump pointer.
+// Mappings are reserved lazily by the kernel, so a big chunk size costs
+// nothing for small programs. Allocations too large to share a chunk get a
+// mapping of their own.
+static const int64_t ArenaAlignment = 64;
+static const int64_t ArenaChunkBytes = int64_t(64) << 20;
+static const int64_t PageBytes = 4096;
+static const int64_t HugePageBytes = int64_t(2) << 20;
+
+struct ArenaChunk {
+  char *Base;
+  int64_t Size;
+  int64_t Used;
+};
+
+static vector<ArenaChunk> ArenaChunks;
+static bool ArenaHugePages = false;
+// Bytes handed out since the last release, and their high-water mark.
+static int64_t ArenaBytes = 0;
+static int64_t ArenaPeakBytes = 0;
+
+static int64_t alignUp(const int64_t n, const int64_t align) {
+  return (n + align - 1) / align * align;
+}
+
+static ArenaChunk mapChunk(const int64_t bytes) {
+  const int64_t Size = alignUp(bytes, ArenaHugePages ? HugePageBytes : PageBytes);
+  void *P = mmap(nullptr, Size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (P == MAP_FAILED) {
+    fprintf(stderr, "Error: array arena could not map %lld bytes\n", (long long) Size);
+    exit(1);
+  }
+#ifdef MADV_HUGEPAGE
+  if (ArenaHugePages) {
+    madvise(P, Size, MADV_HUGEPAGE);
+  }
+#endif
+  return {static_cast<char*>(P), Size, 0};
+}
+
+void *miniapl_arena_alloc(int64_t bytes) {
+  bytes = alignUp(max(bytes, (int64_t) 1), ArenaAlignment);
+  ArenaBytes += bytes;
+  ArenaPeakBytes = max(ArenaPeakBytes, ArenaBytes);
+
+  if (bytes > ArenaChunkBytes / 2) {
+    // Dedicated mapping; keep the current bump chunk at the back.
+    ArenaChunk Big = mapChunk(bytes);
+    Big.Used = Big.Size;
+    ArenaChunks.insert(ArenaChunks.begin(), Big);
+    return Big.Base;
+  }
+
+  if (ArenaChunks.empty() || ArenaChunks.back().Size - ArenaChunks.back().Used < bytes) {
+    ArenaChunks.push_back(mapChunk(ArenaChunkBytes));
+  }
+  ArenaChunk &C = ArenaChunks.back();
+  char *P = C.Base + C.Used;
+  C.Used += bytes;
+  return P;
+}
+
+void miniapl_arena_release() {
+  for (auto &C : ArenaChunks) {
+    munmap(C.Base, C.Size);
+  }
+  ArenaChunks.clear();
+  ArenaBytes = 0;
+}
+
+int64_t miniapl_arena_peak_bytes() {
+  return ArenaPeakBytes;
+}
+
+void miniapl_arena_use_huge_pages(int enable) {
+  ArenaHugePages = enable != 0;
+}
+
+// -------------------------------------------------
+// Array printing
+// -------------------------------------------------
+
+// Output is formatted into one large buffer and handed to stdio with a single
+// fwrite whenever it fills up and at the end of each print.
+static const size_t PrintBufferBytes = 1 << 20;
+// Longest single write: "[" + an int64 or a double with 17 digits + "]".
+static const size_t MaxElementBytes = 32;
+
+static char PrintBuffer[PrintBufferBytes];
+static size_t PrintLength = 0;
+static int64_t PrintedBytes = 0;
+
+static const char DigitPairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static void flushPrintBuffer() {
+  fwrite(PrintBuffer, 1, PrintLength, stdout);
+  PrintedBytes += PrintLength;
+  PrintLength = 0;
+}
+
+static inline void reservePrintBuffer(const size_t bytes) {
+  if (PrintBufferBytes - PrintLength < bytes) {
+    flushPrintBuffer();
+  }
+}
+
+static inline void putChar(const char c) {
+  reservePrintBuffer(1);
+  PrintBuffer[PrintLength++] = c;
+}
+
+// Writes "[<v>]" for one element, converting two digits at a time.
+static inline void putIntElement(const int64_t v) {
+  reservePrintBuffer(MaxElementBytes);
+  char *Out = PrintBuffer + PrintLength;
+  *Out++ = '[';
+  uint64_t u = (uint64_t) v;
+  if (v < 0) {
+    *Out++ = '-';
+    u = 0u - u;
+  }
+  char Digits[20];
+  int n = 0;
+  while (u >= 100) {
+    const uint64_t r = u % 100;
+    u /= 100;
+    Digits[n++] = DigitPairs[2 * r + 1];
+    Digits[n++] = DigitPairs[2 * r];
+  }
+  if (u >= 10) {
+    Digits[n++] = DigitPairs[2 * u + 1];
+    Digits[n++] = DigitPairs[2 * u];
+  } else {
+    Digits[n++] = (char) ('0' + u);
+  }
+  while (n > 0) {
+    *Out++ = Digits[--n];
+  }
+  *Out++ = ']';
+  PrintLength = Out - PrintBuffer;
+}
+
+// Floating point elements use the shortest of %.<p>g, for p up to the type's
+// round-trip precision, that reads back as the same value.
+static inline void putFloatElement(const double v, const int MinDigits, const int MaxDigits,
+    const bool Single) {
+  reservePrintBuffer(MaxElementBytes);
+  char *Out = PrintBuffer + PrintLength;
+  int n = 0;
+  for (int p = MinDigits; p <= MaxDigits; p++) {
+    n = snprintf(Out + 1, MaxElementBytes - 2, "%.*g", p, v);
+    const double Back = strtod(Out + 1, nullptr);
+    if (Single ? (float) Back == (float) v : Back == v) {
+      break;
+    }
+  }
+  Out[0] = '[';
+  Out[n + 1] = ']';
+  PrintLength += n + 2;
+}
+
+template <typename T>
+static inline void putElement(const T v) {
+  putIntElement(v);
+}
+
+static inline void putElement(const float v) {
+  putFloatElement(v, 6, 9, true);
+}
+
+static inline void putElement(const double v) {
+  putFloatElement(v, 15, 17, false);
+}
+
+template <typename T>
+static void printLevel(const T *data, const int64_t *dims, const int32_t rank,
+    const int32_t dim) {
+  putChar('[');
+  if (dim == rank - 1) {
+    for (int64_t i = 0; i < dims[dim]; i++) {
+      putElement(data[i]);
+    }
+  } else {
+    int64_t inner = 1;
+    for (int32_t d = dim + 1; d < rank; d++) {
+      inner *= dims[d];
+    }
+    for (int64_t i = 0; i < dims[dim]; i++) {
+      printLevel(data + i * inner, dims, rank, dim + 1);
+    }
+  }
+  putChar(']');
+}
+
+template <typename T>
+static void printArray(const T *data, const int64_t *dims, const int32_t rank) {
+  if (rank == 0) {
+    putElement(data[0]);
+  } else {
+    printLevel(data, dims, rank, 0);
+  }
+  putChar('\n');
+  flushPrintBuffer();
+}
+
+void miniapl_print_array(const int32_t *data, const int64_t *dims, int32_t rank) {
+  printArray(data, dims, rank);
+}
+
+void miniapl_print_typed_array(const void *data, int32_t type, const int64_t *dims, int32_t rank) {
+  switch (type) {
+    case MINIAPL_I8: printArray(static_cast<const int8_t*>(data), dims, rank); break;
+    case MINIAPL_I16: printArray(static_cast<const int16_t*>(data), dims, rank); break;
+    case MINIAPL_I64: printArray(static_cast<const int64_t*>(data), dims, rank); break;
+    case MINIAPL_F32: printArray(static_cast<const float*>(data), dims, rank); break;
+    case MINIAPL_F64: printArray(static_cast<const double*>(data), dims, rank); break;
+    default: printArray(static_cast<const int32_t*>(data), dims, rank); break;
+  }
+}
+
+int64_t miniapl_printed_bytes() {
+  return PrintedBytes;
+}
+
+// -------------------------------------------------
+// Array files
+// -------------------------------------------------
+
+struct ArrayFileHeader {
+  char Magic[4];
+  uint16_t Rank;
+  uint16_t Type;
+  int64_t Dims[MINIAPL_MAX_RANK];
+};
+
+static_assert(sizeof(ArrayFileHeader) == MINIAPL_FILE_HEADER_BYTES,
+    "array file header layout");
+
+static bool readHeader(const int fd, ArrayFileHeader &H) {
+  return pread(fd, &H, sizeof(H), 0) == (ssize_t) sizeof(H) &&
+      memcmp(H.Magic, "MAPL", 4) == 0 && H.Rank <= MINIAPL_MAX_RANK && H.Type <= MINIAPL_F64;
+}
+
+int32_t miniapl_array_file_shape(const char *path, int32_t *type, int64_t *dims) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  ArrayFileHeader H;
+  bool Ok = readHeader(fd, H);
+  close(fd);
+  if (!Ok) {
+    return -1;
+  }
+  copy(H.Dims, H.Dims + MINIAPL_MAX_RANK, dims);
+  *type = H.Type;
+  return H.Rank;
+}
+
+void *miniapl_load_array(const char *path, int32_t type, const int64_t *dims, int32_t rank) {
+  int fd = open(path, O_RDONLY);
+  ArrayFileHeader H;
+  if (fd < 0 || !readHeader(fd, H)) {
+    fprintf(stderr, "Error: %s is not a MiniAPL array file\n", path);
+    exit(1);
+  }
+  int64_t Elements = 1;
+  bool Match = H.Rank == rank && H.Type == type;
+  for (int32_t d = 0; Match && d < rank; d++) {
+    Match = H.Dims[d] == dims[d];
+    Elements *= dims[d];
+  }
+  struct stat St;
+  const int64_t Bytes = MINIAPL_FILE_HEADER_BYTES + Elements * miniapl_elem_bytes(type);
+  if (!Match || fstat(fd, &St) != 0 || St.st_size < Bytes) {
+    fprintf(stderr, "Error: %s does not hold an array of the expected shape\n", path);
+    exit(1);
+  }
+
+  // The mapping outlives the descriptor and is never unmapped; like arena
+  // memory, it stays valid for the rest of the program.
+  void *P = mmap(nullptr, Bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (P == MAP_FAILED) {
+    fprintf(stderr, "Error: could not map %s\n", path);
+    exit(1);
+  }
+  return static_cast<char*>(P) + MINIAPL_FILE_HEADER_BYTES;
+}
+
+void miniapl_store_array(const char *path, const void *data, int32_t type,
+    const int64_t *dims, int32_t rank) {
+  ArrayFileHeader H;
+  memset(&H, 0, sizeof(H));
+  memcpy(H.Magic, "MAPL", 4);
+  H.Rank = rank;
+  H.Type = type;
+  int64_t Elements = 1;
+  for (int32_t d = 0; d < rank; d++) {
+    H.Dims[d] = dims[d];
+    Elements *= dims[d];
+  }
+
+  FILE *F = fopen(path, "wb");
+  if (!F) {
+    fprintf(stderr, "Error: could not open %s for writing\n", path);
+    exit(1);
+  }
+  // The header goes through stdio's buffer; the elements are large enough
+  // that stdio writes them straight from the array.
+  bool Ok = fwrite(&H, sizeof(H), 1, F) == 1 &&
+      fwrite(data, miniapl_elem_bytes(type), Elements, F) == (size_t) Elements;
+  Ok &= fclose(F) == 0;
+  if (!Ok) {
+    fprintf(stderr, "Error: could not write %s\n", path);
+    exit(1);
+  }
+}
+
+// -------------------------------------------------
+// Parallel loops
+// -------------------------------------------------
+
+// Workers are started on the first parallel loop that needs them and then
+// sleep between loops. The caller publishes a job, takes part in it, and
+// waits until every participating worker has run out of chunks. Chunks are
+// handed out through an atomic counter, so uneven chunks balance out.
+struct ParallelJob {
+  miniapl_range_fn Body;
+  void *Ctx;
+  int64_t N;
+  int64_t Chunk;
+  std::atomic<int64_t> Next;
+};
+
+// Chunks per thread, so that threads finishing early can pick up more work.
+static const int64_t ChunksPerThread = 4;
+
+struct ThreadPool {
+  std::mutex Mutex;
+  std::condition_variable WorkReady;
+  std::condition_variable WorkDone;
+  ParallelJob *Job = nullptr;
+  uint64_t Generation = 0;
+  // Workers with an index below this take part in the current job.
+  int Participants = 0;
+  // Participants that have not finished the current job.
+  int Active = 0;
+  int Workers = 0;
+};
+
+// Never destroyed, so that detached workers can outlive static destructors.
+static ThreadPool *Pool = new ThreadPool();
+static int32_t PoolThreads = 0;
+
+static void runChunks(ParallelJob &J) {
+  for (;;) {
+    const int64_t Begin = J.Next.fetch_add(J.Chunk);
+    if (Begin >= J.N) {
+      return;
+    }
+    J.Body(J.Ctx, Begin, min(Begin + J.Chunk, J.N));
+  }
+}
+
+static void workerMain(const int Index) {
+  uint64_t Seen = 0;
+  std::unique_lock<std::mutex> Lock(Pool->Mutex);
+  for (;;) {
+    Pool->WorkReady.wait(Lock, [&]() { return Pool->Generation != Seen; });
+    Seen = Pool->Generation;
+    if (Index >= Pool->Participants) {
+      continue;
+    }
+    ParallelJob *J = Pool->Job;
+    Lock.unlock();
+    runChunks(*J);
+    Lock.lock();
+    if (--Pool->Active == 0) {
+      Pool->WorkDone.notify_one();
+    }
+  }
+}
+
+static int32_t threadCount() {
+  if (PoolThreads > 0) {
+    return PoolThreads;
+  }
+  return max((int32_t) std::thread::hardware_concurrency(), (int32_t) 1);
+}
+
+void miniapl_set_threads(int32_t threads) {
+  PoolThreads = max(threads, (int32_t) 0);
+}
+
+void miniapl_parallel_for(miniapl_range_fn body, void *ctx, int64_t n, int64_t grain) {
+  const int32_t Threads = threadCount();
+  if (Threads <= 1 || n <= grain) {
+    body(ctx, 0, n);
+    return;
+  }
+
+  ParallelJob J;
+  J.Body = body;
+  J.Ctx = ctx;
+  J.N = n;
+  J.Chunk = alignUp(max(n / (Threads * ChunksPerThread), grain), grain);
+  J.Next = 0;
+
+  {
+    std::lock_guard<std::mutex> Lock(Pool->Mutex);
+    while (Pool->Workers < Threads - 1) {
+      std::thread(workerMain, Pool->Workers++).detach();
+    }
+    Pool->Job = &J;
+    Pool->Participants = Threads - 1;
+    Pool->Active = Threads - 1;
+    Pool->Generation++;
+  }
+  Pool->WorkReady.notify_all();
+
+  runChunks(J);
+
+  std::unique_lock<std::mutex> Lock(Pool->Mutex);
+  Pool->WorkDone.wait(Lock, []() { return Pool->Active == 0; });
+  Pool->Job = nullptr;
+}
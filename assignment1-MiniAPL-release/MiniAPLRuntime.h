@@ -0,0 +1,95 @@
+#ifndef MINIAPL_RUNTIME_H
+#define MINIAPL_RUNTIME_H
+
+#include <cstdint>
+
+// -------------------------------------------------
+// Runtime support for compiled MiniAPL programs.
+//
+// Everything in this header has C linkage so that generated code can call it
+// by name. The JIT resolves these symbols in the host process; programs
+// compiled ahead of time link against libminiapl_runtime.a.
+// -------------------------------------------------
+
+extern "C" {
+
+// Element types of arrays, as passed to the runtime and stored in array
+// files. i32 is 0, so files written before element types existed read as
+// i32 arrays.
+enum miniapl_elem_type {
+  MINIAPL_I32 = 0,
+  MINIAPL_I8 = 1,
+  MINIAPL_I16 = 2,
+  MINIAPL_I64 = 3,
+  MINIAPL_F32 = 4,
+  MINIAPL_F64 = 5
+};
+
+// Size in bytes of one element of the given type.
+int32_t miniapl_elem_bytes(int32_t type);
+
+// Returns `bytes` of 64-byte aligned storage from the array arena. Arena
+// memory is never freed individually; it stays valid until the next call to
+// miniapl_arena_release().
+void *miniapl_arena_alloc(int64_t bytes);
+
+// Releases every array handed out by miniapl_arena_alloc() in one go.
+void miniapl_arena_release();
+
+// Largest number of bytes that were allocated from the arena at one time.
+int64_t miniapl_arena_peak_bytes();
+
+// When enabled, large arena chunks are advised to be backed by transparent
+// huge pages. Only affects chunks mapped after the call.
+void miniapl_arena_use_huge_pages(int enable);
+
+// Prints an array of the given shape to stdout in MiniAPL's nested bracket
+// notation, followed by a newline. `dims` holds `rank` dimension lengths,
+// outermost first; `data` is the row-major element buffer.
+void miniapl_print_array(const int32_t *data, const int64_t *dims, int32_t rank);
+
+// Like miniapl_print_array(), for an array of any element type. Floating
+// point elements are printed with the fewest digits that read back exactly.
+void miniapl_print_typed_array(const void *data, int32_t type, const int64_t *dims, int32_t rank);
+
+// Total number of bytes the array printers have written to stdout.
+int64_t miniapl_printed_bytes();
+
+// Array files hold a 64 byte header followed by the elements as raw
+// little-endian values in row-major order. The header is the magic "MAPL",
+// the rank as a uint16, the element type as a uint16 and up to
+// MINIAPL_MAX_RANK int64 dimension lengths, outermost first, zero-filled.
+#define MINIAPL_MAX_RANK 7
+#define MINIAPL_FILE_HEADER_BYTES 64
+
+// Maps the array file at `path` into memory and returns its elements, with
+// no copy. Exits with an error unless the file holds an array of the given
+// element type and shape. The mapping is private: writes to it never reach
+// the file.
+void *miniapl_load_array(const char *path, int32_t type, const int64_t *dims, int32_t rank);
+
+// Writes an array of the given element type and shape to `path` as an array
+// file.
+void miniapl_store_array(const char *path, const void *data, int32_t type,
+    const int64_t *dims, int32_t rank);
+
+// Reads the element type and shape of the array file at `path` into `type`
+// and `dims`, which must have room for MINIAPL_MAX_RANK entries, and returns
+// its rank. Returns -1 if the file cannot be read or is not an array file.
+int32_t miniapl_array_file_shape(const char *path, int32_t *type, int64_t *dims);
+
+// Body of a parallel loop: processes the indices [begin, end).
+typedef void (*miniapl_range_fn)(void *ctx, int64_t begin, int64_t end);
+
+// Sets how many threads miniapl_parallel_for() uses, counting the calling
+// thread. 0 (the default) uses one per hardware thread.
+void miniapl_set_threads(int32_t threads);
+
+// Runs body over [0, n) split into chunks whose boundaries are multiples of
+// `grain`, on the calling thread and the worker pool, and returns when all of
+// them are done. Ranges of at most `grain` indices run on the caller alone.
+void miniapl_parallel_for(miniapl_range_fn body, void *ctx, int64_t n, int64_t grain);
+
+}
+
+#endif // MINIAPL_RUNTIME_H
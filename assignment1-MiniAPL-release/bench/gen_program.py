@@ -0,0 +1,142 @@
+#!/usr/bin/env python3
+"""Generates synthetic MiniAPL programs for benchmarking.
+
+A program builds two arrays of the requested shape, combines them with a
+chain of elementwise builtins and prints the result reduced to a single
+element, so output stays small at any size. Large arrays are built from
+short mkArray literals with `concat` and `expand`, so the source stays
+under MAX_SOURCE_BYTES at any size too, and are then copied into
+contiguous buffers before the measured chain.
+
+Operation mixes:
+  elementwise  one nested expression of `depth` builtins (fused into a loop)
+  statements   the same chain with every step assigned to its own variable
+  reduce       only the reductions, applied to A (`depth` is ignored)
+"""
+
+import argparse
+import sys
+
+MIXES = ["elementwise", "statements", "reduce"]
+CHAIN_OPS = ["add", "sub", "neg", "exp"]
+# Most values written into one mkArray literal.
+LITERAL_VALUES = 16
+# Upper bound on the size of a generated program, so that the benchmark
+# measures the operations rather than lexing and parsing.
+MAX_SOURCE_BYTES = 64 * 1024
+
+
+def shape_for(elements, rank):
+    """Dimensions of a rank-`rank` array with about `elements` entries."""
+    side = max(1, int(round(elements ** (1.0 / rank))))
+    dims = [side] * (rank - 1)
+    outer = side ** (rank - 1)
+    dims.append(max(1, int(round(float(elements) / outer))))
+    return dims
+
+
+def elements_of(dims):
+    n = 1
+    for d in dims:
+        n *= d
+    return n
+
+
+def literal(count, seed):
+    return "mkArray(1, %d, %s)" % (count, ", ".join(
+        str((i * 7 + seed) % 11 - 5) for i in range(count)))
+
+
+def build_vector(name, count, seed):
+    """Statements assigning a rank-1 array of `count` elements to `name`.
+
+    The array is pieced together from a literal of at most LITERAL_VALUES
+    values: the literal is doubled with `concat` into pieces of 2^k copies,
+    the pieces for the set bits of the number of copies are concatenated and
+    a shorter literal fills in the rest, so the source grows with log(count).
+    """
+    width = min(count, LITERAL_VALUES)
+    copies, rest = divmod(count, width)
+    lines = ["assign %s0 = %s;" % (name, literal(width, seed))]
+    pieces = []
+    k = 0
+    while True:
+        if copies >> k & 1:
+            pieces.append("%s%d" % (name, k))
+        if copies >> (k + 1) == 0:
+            break
+        lines.append("assign %s%d = concat(%s%d, %s%d, 0);" % (name, k + 1, name, k, name, k))
+        k += 1
+    if rest:
+        pieces.append(literal(rest, seed))
+    lines.append("assign %s = %s;" % (name, pieces[0]))
+    for piece in pieces[1:]:
+        lines.append("assign %s = concat(%s, %s, 0);" % (name, name, piece))
+    return lines
+
+
+def build_array(name, dims, seed):
+    """Statements assigning an array of shape `dims` to `name`.
+
+    Its rows are copies of one vector (see build_vector) expanded along the
+    other dimensions. `expand` and `concat` only return views, and `expand`
+    has stride 0 along the new dimensions, which would make every operation
+    re-read a short vector from cache. Unless the array is a single literal
+    it is materialized once with neg(neg(...)), so the measured chain reads
+    a contiguous buffer of the full size.
+    """
+    lines = build_vector(name, dims[-1], seed)
+    for d in dims[:-1]:
+        lines.append("assign %s = expand(%s, %d);" % (name, name, d))
+    if len(lines) > 1:
+        lines.append("assign %s = neg(neg(%s));" % (name, name))
+    return lines
+
+
+def chain_step(i, expr):
+    op = CHAIN_OPS[i % len(CHAIN_OPS)]
+    if op == "neg":
+        return "neg(%s)" % expr
+    if op == "exp":
+        return "exp(%s, 2)" % expr
+    return "%s(%s, B)" % (op, expr)
+
+
+def reduce_fully(expr, rank):
+    for _ in range(rank):
+        expr = "reduce(%s)" % expr
+    return expr
+
+
+def generate(elements, rank, mix, depth):
+    dims = shape_for(elements, rank)
+    lines = build_array("A", dims, 1) + build_array("B", dims, 4)
+    if mix == "statements":
+        for i in range(depth):
+            lines.append("assign C%d = %s;" % (i, chain_step(i, "C%d" % (i - 1) if i else "A")))
+        result = "C%d" % (depth - 1) if depth else "A"
+    elif mix == "reduce":
+        result = "A"
+    else:
+        result = "A"
+        for i in range(depth):
+            result = chain_step(i, result)
+    lines.append("%s;" % reduce_fully(result, rank))
+    source = "\n".join(lines) + "\n"
+    assert len(source) <= MAX_SOURCE_BYTES, "generated program is %d bytes" % len(source)
+    return source
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--elements", type=int, default=1000)
+    parser.add_argument("--rank", type=int, default=1)
+    parser.add_argument("--mix", choices=MIXES, default="elementwise")
+    parser.add_argument("--depth", type=int, default=1)
+    args = parser.parse_args()
+    sys.stdout.write(generate(args.elements, args.rank, args.mix, args.depth))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,130 @@
+#!/usr/bin/env python3
+"""Runs mini-apl over a grid of generated programs and records the results.
+
+For every combination of array size, rank, operation mix and chain depth a
+program is generated with gen_program.py and run once with --stats=json.
+One CSV row is written per configuration with its compile time (every
+phase before execution), execution time, peak resident set size and IR
+instruction counts. Runs that fail or time out are recorded with their
+status and no measurements.
+"""
+
+import argparse
+import csv
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import gen_program
+
+EXECUTION_PHASES = ("execution", "interpretation")
+
+FIELDS = ["elements", "rank", "mix", "depth", "actual_elements", "status",
+          "compile_ms", "execution_ms", "wall_ms", "peak_rss_kb",
+          "ir_instructions", "optimized_ir_instructions", "arena_peak_bytes"]
+
+
+def int_list(text):
+    return [int(float(x)) for x in text.split(",") if x]
+
+
+def run_one(mini_apl, flags, program, timeout):
+    """Runs one program; returns (status, stats, wall seconds, peak RSS in KiB)."""
+    with tempfile.NamedTemporaryFile("w", suffix=".mapl", delete=False) as f:
+        f.write(program)
+        path = f.name
+    err = tempfile.TemporaryFile()
+    try:
+        start = time.time()
+        proc = subprocess.Popen([mini_apl] + flags + ["--stats=json", path],
+                                stdout=subprocess.DEVNULL, stderr=err)
+        # Reap the child with wait4 so its own peak RSS is available.
+        while True:
+            pid, wait_status, usage = os.wait4(proc.pid, os.WNOHANG)
+            if pid:
+                break
+            if time.time() - start > timeout:
+                proc.kill()
+                os.wait4(proc.pid, 0)
+                return "timeout", {}, time.time() - start, 0
+            time.sleep(0.001)
+        wall = time.time() - start
+        # ru_maxrss is in KiB on Linux.
+        rss = usage.ru_maxrss
+        if not os.WIFEXITED(wait_status) or os.WEXITSTATUS(wait_status) != 0:
+            return "failed", {}, wall, rss
+        stats = {}
+        err.seek(0)
+        for line in err.read().decode("utf-8", "replace").splitlines():
+            if line.startswith("{"):
+                stats = json.loads(line)
+        return "ok", stats, wall, rss
+    finally:
+        err.close()
+        os.unlink(path)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--mini-apl", default="bin/mini-apl")
+    parser.add_argument("--out", default="build/bench.csv")
+    parser.add_argument("--sizes", type=int_list, default=[10 ** k for k in range(2, 9)],
+                        help="comma separated element counts (default 1e2..1e8)")
+    parser.add_argument("--ranks", type=int_list, default=list(range(1, 7)))
+    parser.add_argument("--mixes", default=",".join(gen_program.MIXES))
+    parser.add_argument("--depths", type=int_list, default=[1, 4, 16])
+    parser.add_argument("--max-elements", type=int, default=0,
+                        help="skip sizes above this many elements (0 = no limit)")
+    parser.add_argument("--timeout", type=float, default=300)
+    parser.add_argument("--flags", default="--jit --fold-limit 0",
+                        help="options passed to mini-apl (default forces the JIT)")
+    args = parser.parse_args()
+
+    out_dir = os.path.dirname(args.out)
+    if out_dir and not os.path.isdir(out_dir):
+        os.makedirs(out_dir)
+    flags = args.flags.split()
+    mixes = [m for m in args.mixes.split(",") if m]
+
+    with open(args.out, "w") as out:
+        writer = csv.DictWriter(out, fieldnames=FIELDS)
+        writer.writeheader()
+        for size in args.sizes:
+            if args.max_elements and size > args.max_elements:
+                continue
+            for rank in args.ranks:
+                for mix in mixes:
+                    depths = [0] if mix == "reduce" else args.depths
+                    for depth in depths:
+                        dims = gen_program.shape_for(size, rank)
+                        program = gen_program.generate(size, rank, mix, depth)
+                        status, stats, wall, rss = run_one(args.mini_apl, flags, program, args.timeout)
+                        phases = stats.get("phases_ms", {})
+                        counters = stats.get("counters", {})
+                        row = {
+                            "elements": size, "rank": rank, "mix": mix, "depth": depth,
+                            "actual_elements": gen_program.elements_of(dims),
+                            "status": status,
+                            "wall_ms": "%.3f" % (wall * 1e3),
+                            "peak_rss_kb": rss,
+                        }
+                        if phases:
+                            row["compile_ms"] = "%.3f" % sum(
+                                v for k, v in phases.items() if k not in EXECUTION_PHASES)
+                            row["execution_ms"] = "%.3f" % sum(
+                                v for k, v in phases.items() if k in EXECUTION_PHASES)
+                        for key in ("ir_instructions", "optimized_ir_instructions", "arena_peak_bytes"):
+                            if key in counters:
+                                row[key] = counters[key]
+                        writer.writerow(row)
+                        out.flush()
+                        print("%-10d rank %d %-12s depth %-3d %s" % (size, rank, mix, depth, status))
+
+
+if __name__ == "__main__":
+    main()
@@ -1,23 +1,35 @@
 #include "MiniAPLJIT.h"
+#include "MiniAPLRuntime.h"
 
 #include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/DenseSet.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Support/DynamicLibrary.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/Support/Host.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/TargetRegistry.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Utils/SimplifyLibCalls.h"
 #include "llvm/Transforms/Scalar/GVN.h"
@@ -25,16 +37,22 @@
 
 #include <algorithm>
 #include <cctype>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <iostream>
 #include <fstream>
 #include <map>
 #include <memory>
+#include <set>
+#include <sstream>
 #include <string>
-#include <regex>
+#include <unordered_map>
 #include <vector>
 #include <cassert>
+#include <functional>
 
 using namespace llvm;
 using namespace llvm::orc;
@@ -56,14 +74,6 @@ string str(const int i) {
   return to_string(i);
 }
 
-bool is_int( const std::string& str ) { // check with regex (does not accept leading zeroes before first digit)
-  static constexpr auto max_digits = std::numeric_limits<int>::digits10 ;
-  static const std::string ub = std::to_string(max_digits-1) ;
-  static const std::regex int_re( "^\\s*([+-]?[1-9]\\d{0," + ub + "}|0)\\s*$" ) ;
-
-  return std::regex_match( str, int_re ) ;
-}
-
 // -------------------------------------------------
 // Type information for MiniAPL programs
 // -------------------------------------------------
@@ -71,7 +81,63 @@ bool is_int( const std::string& str ) { // check with regex (does not accept lea
 enum ExprType {
   EXPR_TYPE_SCALAR,
   EXPR_TYPE_FUNCALL,
-  EXPR_TYPE_VARIABLE 
+  EXPR_TYPE_VARIABLE,
+  EXPR_TYPE_FUSED,
+  EXPR_TYPE_CONSTANT,
+  EXPR_TYPE_STRING,
+  EXPR_TYPE_ELEM_TYPE
+};
+
+// Element type of an array. The values are the runtime's miniapl_elem_type
+// codes, and the zero value is the default i32.
+enum ElemType {
+  ELEM_I32 = MINIAPL_I32,
+  ELEM_I8 = MINIAPL_I8,
+  ELEM_I16 = MINIAPL_I16,
+  ELEM_I64 = MINIAPL_I64,
+  ELEM_F32 = MINIAPL_F32,
+  ELEM_F64 = MINIAPL_F64
+};
+
+static const char *ElemTypeNames[] = {"i32", "i8", "i16", "i64", "f32", "f64"};
+
+// Looks up the element type spelled Name. Returns false for other names.
+static bool ParseElemType(StringRef Name, ElemType& Elem) {
+  for (int i = 0; i < 6; i++) {
+    if (Name == ElemTypeNames[i]) {
+      Elem = (ElemType) i;
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool IsFloatElem(const ElemType Elem) {
+  return Elem == ELEM_F32 || Elem == ELEM_F64;
+}
+
+// The type both operands of add, sub or concat are converted to: floating
+// point if either is, and otherwise the wider of the two.
+static ElemType PromoteElemTypes(const ElemType A, const ElemType B) {
+  if (IsFloatElem(A) || IsFloatElem(B)) {
+    return A == ELEM_F64 || B == ELEM_F64 ? ELEM_F64 : ELEM_F32;
+  }
+  return miniapl_elem_bytes(A) >= miniapl_elem_bytes(B) ? A : B;
+}
+
+// Where the elements of an array are, relative to the one or two buffers it
+// is read from. Most builtins produce contiguous row-major arrays
+// (Segments == 0). expand and concat instead describe their result as a
+// view of their operands' buffers: element idx is element
+// Offset[s] + sum(idx[d] * Strides[s][d]) of buffer s, where s is 1 if there
+// are two segments and idx[SplitDim] >= Split, and 0 otherwise. A stride of
+// 0 repeats a dimension. The innermost stride is always 1.
+struct ArrayLayout {
+  int Segments;
+  vector<int64_t> Strides[2];
+  int64_t Offset[2];
+  int SplitDim;
+  int64_t Split;
 };
 
 class MiniAPLArrayType {
@@ -82,9 +148,13 @@ class MiniAPLArrayType {
     int concat_dim1;
     int concat_dim2;
     int dim_to_concat;
+    ElemType elem;
+    // Set during codegen; views exist only in generated code.
+    ArrayLayout layout;
 
-    int Cardinality() {
-      int C = 1;
+    // Number of elements. CheckArraySize bounds it for every array type.
+    int64_t Cardinality() {
+      int64_t C = 1;
       for (auto D : dimensions) {
         C *= D;
       }
@@ -101,6 +171,9 @@ class MiniAPLArrayType {
 };
 
 std::ostream& operator<<(std::ostream& out, MiniAPLArrayType& tp) {
+  if (tp.elem != ELEM_I32) {
+    out << ElemTypeNames[tp.elem];
+  }
   out << "[";
   int i = 0;
   for (auto T : tp.dimensions) {
@@ -211,6 +284,36 @@ class NumberASTNode : public ASTNode {
     }
 };
 
+// A string literal; the path argument of load and store.
+class StringASTNode : public ASTNode {
+  public:
+    std::string Val;
+    StringASTNode(const std::string &Val) : Val(Val) {}
+
+    Value *codegen(Function* F) override;
+
+    virtual ExprType GetType() override { return EXPR_TYPE_STRING; }
+
+    virtual void Print(std::ostream& out) override {
+      out << '"' << Val << '"';
+    }
+};
+
+// An element type name; the optional type argument of load.
+class ElemTypeASTNode : public ASTNode {
+  public:
+    ElemType Val;
+    ElemTypeASTNode(ElemType Val) : Val(Val) {}
+
+    Value *codegen(Function* F) override { return nullptr; }
+
+    virtual ExprType GetType() override { return EXPR_TYPE_ELEM_TYPE; }
+
+    virtual void Print(std::ostream& out) override {
+      out << ElemTypeNames[Val];
+    }
+};
+
 class CallASTNode : public ASTNode {
 
   public:
@@ -234,24 +337,224 @@ class CallASTNode : public ASTNode {
     }
 };
 
+// Element values of an array known at compile time.
+typedef std::shared_ptr<const vector<int32_t> > ArrayData;
+
+// An array whose shape and values are known at compile time: an mkArray
+// literal, or the folded result of a builtin applied to such literals.
+// Values are integers converted to the element type.
+//
+// Printed statements are the keys of common subexpressions, REPL statements
+// and cached objects, so a literal of more than PrintedValues values prints
+// an MD5 of them instead, computed once, rather than every value as text.
+class ArrayConstASTNode : public ASTNode {
+  public:
+    static const int PrintedValues = 16;
+
+    vector<int> Dims;
+    ArrayData Vals;
+    ElemType Elem;
+    ArrayConstASTNode(const vector<int>& Dims, ArrayData Vals, ElemType Elem = ELEM_I32)
+      : Dims(Dims), Vals(Vals), Elem(Elem) {}
+
+    const std::string& ValuesDigest() {
+      if (Digest.empty()) {
+        MD5 Hash;
+        Hash.update(StringRef(reinterpret_cast<const char*>(Vals->data()),
+                              Vals->size() * sizeof(int32_t)));
+        MD5::MD5Result Result;
+        Hash.final(Result);
+        Digest = Result.digest().str().str();
+      }
+      return Digest;
+    }
+
+    Value *codegen(Function* F) override;
+    virtual ExprType GetType() override { return EXPR_TYPE_CONSTANT; }
+    virtual void Print(std::ostream& out) override {
+      out << "mkArray(";
+      if (Elem != ELEM_I32) {
+        out << ElemTypeNames[Elem] << ", ";
+      }
+      out << Dims.size();
+      for (auto D : Dims) {
+        out << ", " << D;
+      }
+      if ((int) Vals->size() > PrintedValues) {
+        out << ", md5 " << ValuesDigest();
+      } else {
+        for (auto V : *Vals) {
+          out << ", " << V;
+        }
+      }
+      out << ")";
+    }
+
+  private:
+    std::string Digest;
+};
+
+// True for builtins that combine their array operands element by element.
+static bool IsElementwiseCall(ASTNode* Expr) {
+  if (Expr->GetType() != EXPR_TYPE_FUNCALL) {
+    return false;
+  }
+  const string& Callee = static_cast<CallASTNode*>(Expr)->Callee;
+  return Callee == "add" || Callee == "sub" || Callee == "neg" || Callee == "exp";
+}
+
+// Number of leading arguments of an elementwise builtin that are arrays;
+// the remaining one (exp's power) is a scalar.
+static int ElementwiseArrayArgs(CallASTNode* Call) {
+  return Call->Callee == "add" || Call->Callee == "sub" ? 2 : 1;
+}
+
+// A tree of nested elementwise builtins computed by a single loop, created by
+// FuseElementwise after type checking. Leaves are the operands of the tree
+// that are not elementwise themselves; they are materialized before the loop
+// and read once per element, and only the root's result is stored.
+class FusedASTNode : public ASTNode {
+  public:
+    std::unique_ptr<ASTNode> Root;
+    std::vector<ASTNode*> Leaves;
+
+    Value *codegen(Function* F) override;
+    virtual ExprType GetType() override { return EXPR_TYPE_FUSED; }
+    virtual void Print(std::ostream& out) override {
+      Root->Print(out);
+    }
+};
+
 
 // ---------------------------------------------------------------------------
 // Some global variables used in parsing, type-checking, and code generation.
 // ---------------------------------------------------------------------------
-static map<ASTNode*, MiniAPLArrayType> TypeTable;
-static map<string, Value*> ValueTable;
+static unordered_map<ASTNode*, MiniAPLArrayType> TypeTable;
+
+// What a variable name is bound to: the type of the array most recently
+// assigned to it and, during codegen, the buffer holding that array (and,
+// for a concatenation view, the buffer of its second segment; the view's
+// layout is in Type). Reassignment overwrites the slot, so each use sees the
+// binding in effect at its statement. Type checking fills in Type and
+// codegen fills in Val as they walk the statements in order.
+struct Binding {
+  MiniAPLArrayType Type;
+  Value *Val;
+  Value *Val2;
+};
+static unordered_map<string, Binding> Environment;
 static LLVMContext TheContext;
 // NOTE: You will probably want to use the Builder in the "codegen" methods
 static IRBuilder<> Builder(TheContext);
 static std::unique_ptr<Module> TheModule;
 static std::unique_ptr<legacy::FunctionPassManager> TheFPM;
+static std::unique_ptr<legacy::PassManager> TheMPM;
+// Optimization level selected with -O<n>.
+static unsigned OptLevel = 2;
+// Builtin results of up to this many elements are computed at compile time
+// when their operands are known (--fold-limit; 0 disables folding).
+static int FoldLimit = 1 << 16;
 static std::unique_ptr<MiniAPLJIT> TheJIT;
+// Print the generated LLVM IR to stderr before optimization (--dump-ir).
+static bool DumpIR = false;
+// Call kernels shared by every call site of an operation instead of
+// specializing each one on its shape (--kernels).
+static bool KernelLibrary = false;
+
+// ---------------------------------------------------------------------------
+// Statistics (--stats)
+//
+// The driver marks the end of each phase; the time since the previous mark
+// is added to that phase, so phases that run repeatedly (as in the REPL)
+// accumulate. Everything is reported to stderr when the process exits.
+// ---------------------------------------------------------------------------
+enum StatsFormat {
+  STATS_NONE,
+  STATS_TEXT,
+  STATS_JSON
+};
+
+static StatsFormat StatsOutput = STATS_NONE;
+static vector<pair<string, double> > PhaseSeconds;
+static vector<pair<string, int64_t> > StatCounters;
+static std::chrono::steady_clock::time_point PhaseStart = std::chrono::steady_clock::now();
+
+// Starts timing a phase without charging the time so far to any phase.
+static void StartPhase() {
+  PhaseStart = std::chrono::steady_clock::now();
+}
+
+// Adds the time since the last mark to phase Name.
+static void EndPhase(const string& Name) {
+  auto Now = std::chrono::steady_clock::now();
+  double Seconds = std::chrono::duration<double>(Now - PhaseStart).count();
+  PhaseStart = Now;
+  for (auto& P : PhaseSeconds) {
+    if (P.first == Name) {
+      P.second += Seconds;
+      return;
+    }
+  }
+  PhaseSeconds.push_back({Name, Seconds});
+}
+
+// Adds Value to counter Name.
+static void CountStat(const string& Name, const int64_t Value) {
+  for (auto& C : StatCounters) {
+    if (C.first == Name) {
+      C.second += Value;
+      return;
+    }
+  }
+  StatCounters.push_back({Name, Value});
+}
+
+static int64_t CountInstructions(Module& M) {
+  int64_t Count = 0;
+  for (auto& Fn : M) {
+    for (auto& BB : Fn) {
+      Count += BB.size();
+    }
+  }
+  return Count;
+}
+
+static void ReportStats() {
+  CountStat("arena_peak_bytes", miniapl_arena_peak_bytes());
+  CountStat("printed_bytes", miniapl_printed_bytes());
+
+  if (StatsOutput == STATS_JSON) {
+    fprintf(stderr, "{\"phases_ms\": {");
+    for (int i = 0; i < (int) PhaseSeconds.size(); i++) {
+      fprintf(stderr, "%s\"%s\": %.3f", i ? ", " : "", PhaseSeconds[i].first.c_str(),
+          PhaseSeconds[i].second * 1e3);
+    }
+    fprintf(stderr, "}, \"counters\": {");
+    for (int i = 0; i < (int) StatCounters.size(); i++) {
+      fprintf(stderr, "%s\"%s\": %lld", i ? ", " : "", StatCounters[i].first.c_str(),
+          (long long) StatCounters[i].second);
+    }
+    fprintf(stderr, "}}\n");
+    return;
+  }
+
+  double Total = 0;
+  fprintf(stderr, "=== mini-apl statistics ===\n");
+  for (auto& P : PhaseSeconds) {
+    fprintf(stderr, "  %-24s %12.3f ms\n", P.first.c_str(), P.second * 1e3);
+    Total += P.second;
+  }
+  fprintf(stderr, "  %-24s %12.3f ms\n", "total", Total * 1e3);
+  for (auto& C : StatCounters) {
+    fprintf(stderr, "  %-24s %12lld\n", C.first.c_str(), (long long) C.second);
+  }
+}
 
 // ---------------------------------------------------------------------------
 // LLVM codegen helpers
 // ---------------------------------------------------------------------------
 IntegerType* intTy(const int width) {
-  return IntegerType::get(TheContext, 32);
+  return IntegerType::get(TheContext, width);
 }
 
 ConstantInt* intConst(const int width, const int i) {
@@ -259,25 +562,48 @@ ConstantInt* intConst(const int width, const int i) {
   return const_int32;
 }
 
-static void InitializeModuleAndPassManager() {
+static void InitializeModuleAndPassManager(TargetMachine &TM) {
   // Open a new module.
-  TheModule->setDataLayout(TheJIT->getTargetMachine().createDataLayout());
+  TheModule->setDataLayout(TM.createDataLayout());
+  TheModule->setTargetTriple(TM.getTargetTriple().str());
 
-  // Create a new pass manager attached to it.
+  // Create new pass managers attached to it.
   TheFPM = llvm::make_unique<legacy::FunctionPassManager>(TheModule.get());
+  TheMPM = llvm::make_unique<legacy::PassManager>();
+
+  // Let the vectorizers and unroller see the real costs of the host target.
+  TheFPM->add(createTargetTransformInfoWrapperPass(TM.getTargetIRAnalysis()));
+  TheMPM->add(createTargetTransformInfoWrapperPass(TM.getTargetIRAnalysis()));
+
+  // Use the same pipeline as clang -O<n>: instcombine, GVN, LICM, loop
+  // unrolling and, from -O2 up, the loop and SLP vectorizers.
+  PassManagerBuilder PMB;
+  PMB.OptLevel = OptLevel;
+  if (OptLevel > 0) {
+    PMB.Inliner = createFunctionInliningPass(OptLevel, 0, false);
+  }
+  PMB.LoopVectorize = OptLevel > 1;
+  PMB.SLPVectorize = OptLevel > 1;
+  TM.adjustPassManager(PMB);
 
-  // Do simple "peephole" optimizations and bit-twiddling optzns.
-  TheFPM->add(createInstructionCombiningPass());
-  // Reassociate expressions.
-  TheFPM->add(createReassociatePass());
-  // Eliminate Common SubExpressions.
-  TheFPM->add(createGVNPass());
-  // Simplify the control flow graph (deleting unreachable blocks, etc).
-  TheFPM->add(createCFGSimplificationPass());
+  PMB.populateFunctionPassManager(*TheFPM);
+  PMB.populateModulePassManager(*TheMPM);
 
   TheFPM->doInitialization();
 }
 
+// Runs the optimization pipeline over the whole module before it is handed
+// to the JIT.
+static void OptimizeModule() {
+  for (auto &Fn : *TheModule) {
+    if (!Fn.isDeclaration()) {
+      TheFPM->run(Fn);
+    }
+  }
+  TheFPM->doFinalization();
+  TheMPM->run(*TheModule);
+}
+
 // NOTE: This utility function generates LLVM IR to print out the string "to_print"
 void kprintf_str(Module *mod, BasicBlock *bb, const std::string& to_print) {
   Function *func_printf = mod->getFunction("printf");
@@ -333,675 +659,1544 @@ Value *LogErrorV(const char *Str) {
 }
 
 // ---------------------------------------------------------------------------
-// Code generation functions that you should fill in for this assignment
+// Array storage helpers
+//
+// Every MiniAPL array is a flat, row-major buffer of elements of its element
+// type allocated from the runtime arena (see MiniAPLRuntime.h). Codegen
+// passes arrays around as a pointer to the first element, typed by the
+// element type, so the helpers below read the element type off the pointer.
 // ---------------------------------------------------------------------------
-Value *ProgramAST::codegen(Function* F) {
-  // STUDENTS: FILL IN THIS FUNCTION
-  for(auto& Stmt : Stmts) {
-    Stmt->codegen(F);
-  }
-  return nullptr;
-}
 
-Value *AssignStmtAST::codegen(Function* F) {
-  // STUDENTS: FILL IN THIS FUNCTION
-  Value* rhsValue = RHS->codegen(F);
-  if (!rhsValue)
-    return nullptr;
-  string Name = GetName();
-  // printf("AssignStmtAST Name, %s\n", Name.c_str());
-  ValueTable[Name] = rhsValue;
-  return rhsValue;
+// Returns the declaration of a MiniAPL runtime function, adding it to the
+// current module the first time it is referenced.
+Function *runtimeFunction(const std::string& Name, Type* Ret, ArrayRef<Type*> Params) {
+  Function *Fn = TheModule->getFunction(Name);
+  if (!Fn) {
+    FunctionType *FT = FunctionType::get(Ret, Params, false);
+    Fn = Function::Create(FT, GlobalValue::ExternalLinkage, Name, TheModule.get());
+    Fn->setCallingConv(CallingConv::C);
+  }
+  return Fn;
 }
 
-
-Value *ExprStmtAST::codegen(Function* F) {
-  // STUDENTS: FILL IN THIS FUNCTION
-  // printf("ExprStmtAST\n");
-  // Val->Print(std::cout);
-  return Val->codegen(F);
+Type *elemTy(const ElemType Elem) {
+  switch (Elem) {
+    case ELEM_I8: return Type::getInt8Ty(TheContext);
+    case ELEM_I16: return Type::getInt16Ty(TheContext);
+    case ELEM_I64: return Type::getInt64Ty(TheContext);
+    case ELEM_F32: return Type::getFloatTy(TheContext);
+    case ELEM_F64: return Type::getDoubleTy(TheContext);
+    default: return intTy(32);
+  }
 }
 
-Value *NumberASTNode::codegen(Function* F) {
-  // STUDENTS: FILL IN THIS FUNCTION
-  return ConstantInt::get(TheContext, APInt(32, Val));
+PointerType* arrayPtrTy(const ElemType Elem = ELEM_I32) {
+  return PointerType::get(elemTy(Elem), 0);
 }
 
-Value *VariableASTNode::codegen(Function* F) {
-  // STUDENTS: FILL IN THIS FUNCTION
-  // printf("VariableASTNode Name, %s\n", Name.c_str());
-  Value *V = ValueTable[Name];
-  if (!V)
-    LogErrorV("Unknown variable name");
-  return V;
+// Element type of the array `array` points to.
+Type *arrayElemTy(Value* array) {
+  return array->getType()->getPointerElementType();
 }
 
-void codegen_print_array(vector<int> dims, Value* array_data, Module *m, BasicBlock *bb, unsigned dim, unsigned prefix) {
-  kprintf_str(m, bb, "[");
-  unsigned current_dim = dims[dim];
-  int prev_dim = 1;
-
-  // 2 3 4
-  // 12
-  for (unsigned i = dim + 1; i < dims.size(); ++i) {
-    prev_dim *= dims[i];
-  }
-  // cout << "current_dim " << current_dim << " prev_dim " << prev_dim << endl;
-
-  // for (unsigned i = 0; i < size; ++i) {
-    //   cout << "i " << i << endl;
-    //   // Value* element_ptr = Builder.CreateGEP(arg0, {intConst(32, 0), intConst(32, i)});
-    //   // Value* element_i = Builder.CreateLoad(element_ptr);
-    //   Value* element_i = Builder.CreateExtractElement(arg0, i);
-    //   // Value* arg_i = Args[i] -> codegen(F);
-    //   kprintf_str(m, bb, "[");
-    //   kprintf_val(m, bb, element_i);
-    //   kprintf_str(m, bb, "]");
-    // }
-
-
-  for (unsigned i = 0; i < current_dim; ++i) {
-    if (dim == dims.size() - 1) {
-      // cout << "prefix " << prefix << " i " << i << endl;
-      // Value* element_ptr = Builder.CreateGEP(array_data, {intConst(32, 0), intConst(32, prefix + i)});
-      // // cout << "after gep" << endl;
-      // Value* element_i = Builder.CreateLoad(element_ptr);
-      Value* element_i = Builder.CreateExtractElement(array_data, prefix + i);
-      // cout << "before kprintf_val" << endl;
-      kprintf_str(m, bb, "[");
-      kprintf_val(m, bb, element_i);
-      kprintf_str(m, bb, "]");
-      // cout << "after kprintf_val" << endl;
-    } else {
-      // cout << "recursive" << endl;
-      codegen_print_array(dims, array_data, m, bb, dim + 1, prefix + i * prev_dim);
-    }
-  }
-  kprintf_str(m, bb, "]");
+int elemBytes(Type* Elem) {
+  return Elem->getPrimitiveSizeInBits() / 8;
 }
-Value *CallASTNode::codegen(Function* F) {
-  // Look up the name in the global module table.
-  // printf("CallASTNode Callee, %s\n", Callee.c_str());
 
-  // std::vector<Value *> ArgsV;
-  // for (unsigned i = 0, e = Args.size(); i != e; ++i) {
-  //   ArgsV.push_back(Args[i]->codegen(F));
-  //   if (!ArgsV.back())
-  //     return nullptr;
-  // }
+// ---------------------------------------------------------------------------
+// Buffer reuse
+//
+// A liveness pass (AnalyzeLiveness) finds the statement where each variable
+// is read for the last time. Codegen uses it to track which arena buffers
+// are still needed: an elementwise builtin writes its result over an operand
+// that dies with it, and other results take a dead buffer of the same size
+// before allocating a new one. Constants and loaded files are never reused.
+// All of this is decided at compile time; statements run in order, so a
+// buffer is dead for the rest of the program once it is released.
+// ---------------------------------------------------------------------------
 
-  BasicBlock *bb = Builder.GetInsertBlock();
-  Module *m = TheModule.get();
-  
-  if (Callee == "add") {
-    // Get the type of the result (and operands).
-    MiniAPLArrayType type = TypeTable[this];
-    const int size = type.Cardinality();
-    // Get an LLVM type for the flattened array.
-    auto *vec_type = VectorType::get(intTy(32), size);
+// What the liveness pass records about a statement.
+struct StmtLiveness {
+  // Variables read here for the last time.
+  vector<string> Dying;
+  // How many times each variable is read here.
+  unordered_map<string, int> Reads;
+  // Whether the array assigned here is never read.
+  bool DeadStore;
+};
 
-    // Codegen arguments.
-    Value *arg0 = Args[0]->codegen(F);
-    Value *arg1 = Args[1]->codegen(F);
+static unordered_map<StmtAST*, StmtLiveness> Liveness;
+// Liveness of the statement being generated; nullptr when unknown, as for
+// REPL statements, whose variables outlive them.
+static const StmtLiveness *CurrentLiveness = nullptr;
+
+// Size in bytes of each buffer codegen allocated from the arena.
+static unordered_map<Value*, int64_t> OwnedBuffers;
+// Number of variables bound to each buffer.
+static unordered_map<Value*, int> BufferRefs;
+// Owned buffers no longer needed, by size in bytes, in the order they were
+// released, and the set of all of them.
+static unordered_map<int64_t, std::deque<Value*>> FreeBuffers;
+static DenseSet<Value*> FreeBufferSet;
+
+// Forgets the buffers of the previous module.
+void ResetBuffers() {
+  OwnedBuffers.clear();
+  BufferRefs.clear();
+  FreeBuffers.clear();
+  FreeBufferSet.clear();
+  CurrentLiveness = nullptr;
+}
 
-    // Load from the arguments.
-    arg0 = Builder.CreateLoad(vec_type, arg0);
-    arg1 = Builder.CreateLoad(vec_type, arg1);
+// Allocates an uninitialized array of `size` elements of type Elem from the
+// arena.
+Value *allocArray(const int64_t size, Type* Elem) {
+  Function *Alloc = runtimeFunction("miniapl_arena_alloc",
+      Type::getInt8PtrTy(TheContext), {Type::getInt64Ty(TheContext)});
+  Value *Bytes = ConstantInt::get(Type::getInt64Ty(TheContext), size * elemBytes(Elem));
+  Value *Raw = Builder.CreateCall(Alloc, {Bytes});
+  Value *Buffer = Builder.CreateBitCast(Raw, PointerType::get(Elem, 0));
+  OwnedBuffers[Buffer] = size * elemBytes(Elem);
+  return Buffer;
+}
 
-    // Construct an add (this builds a vector addition).
-    Value *add = Builder.CreateAdd(arg0, arg1);
+// Returns an uninitialized array of `size` elements of type Elem: the oldest
+// released buffer of exactly that size if there is one, otherwise a new one.
+Value *takeBuffer(const int64_t size, Type* Elem) {
+  const int64_t Bytes = size * elemBytes(Elem);
+  auto Free = FreeBuffers.find(Bytes);
+  if (Free == FreeBuffers.end() || Free->second.empty()) {
+    return allocArray(size, Elem);
+  }
+  Value *Buffer = Free->second.front();
+  Free->second.pop_front();
+  FreeBufferSet.erase(Buffer);
+  CountStat("reused_buffers", 1);
+  if (arrayElemTy(Buffer) != Elem) {
+    Buffer = Builder.CreateBitCast(Buffer, PointerType::get(Elem, 0));
+    OwnedBuffers[Buffer] = Bytes;
+  }
+  return Buffer;
+}
 
-    
+// Makes V available to takeBuffer if it is an arena buffer that no variable
+// is bound to.
+void releaseBuffer(Value* V) {
+  if (V && OwnedBuffers.count(V) && BufferRefs[V] == 0 && FreeBufferSet.insert(V).second) {
+    FreeBuffers[OwnedBuffers[V]].push_back(V);
+  }
+}
 
-    // Allocate a vector of size `size` and type int32.
-    auto alloc = Builder.CreateAlloca(vec_type);
-    // Get a pointer to the start of the allocation.
-    // See https://releases.llvm.org/6.0.0/docs/GetElementPtr.html for more details.
-    auto dst = Builder.CreateGEP(alloc, {intConst(32, 0), intConst(32, 0)});
-    // Store the add in the destination.
-    Builder.CreateStore(add, dst);
+// An array as codegen sees it: the buffers holding its elements and how
+// they are laid out in them. Base[1] is only used by two segment views.
+struct ArrayView {
+  Value *Base[2];
+  ArrayLayout Layout;
+};
 
-    
+ArrayView contiguousView(Value* Buffer) {
+  ArrayView V = {{Buffer, nullptr}};
+  return V;
+}
 
-    // for (unsigned i = 0; i < size; ++i) {
-    //   Value* element_ptr = Builder.CreateGEP(alloc, {intConst(32, 0), intConst(32, i)});
-    //   Value* element_i = Builder.CreateLoad(element_ptr);
-    //   kprintf_str(m, bb, "[");
-    //   kprintf_val(m, bb, element_i);
-    //   kprintf_str(m, bb, "]");
-    // }
+// Releases the operands of a builtin once it has computed Result. Only
+// temporaries are actually released; variables are released by
+// ProgramAST::codegen after their last statement.
+void releaseOperands(const vector<ArrayView>& Operands, Value* Result) {
+  for (auto& V : Operands) {
+    for (auto *B : V.Base) {
+      if (B != Result) {
+        releaseBuffer(B);
+      }
+    }
+  }
+}
 
-    // codegen_print_array(type.dimensions, alloc, m, bb, 0, 0);
-    Value* arg_print = Builder.CreateLoad(vec_type, alloc);
-    codegen_print_array(type.dimensions, arg_print, m, bb, 0, 0);
-    kprintf_str(m, bb, "\n");
+// True if nothing reads the buffer V, which Arg evaluated to, after the
+// builtin Arg is an operand of: V is a temporary, or a variable read only
+// there and for the last time that no other variable shares.
+bool isDying(ASTNode* Arg, Value* V) {
+  if (!OwnedBuffers.count(V)) {
+    return false;
+  }
+  if (Arg->GetType() == EXPR_TYPE_FUNCALL || Arg->GetType() == EXPR_TYPE_FUSED) {
+    return BufferRefs[V] == 0;
+  }
+  if (Arg->GetType() != EXPR_TYPE_VARIABLE || !CurrentLiveness || BufferRefs[V] != 1) {
+    return false;
+  }
+  const string& Name = static_cast<VariableASTNode*>(Arg)->Name;
+  auto Reads = CurrentLiveness->Reads.find(Name);
+  const vector<string>& Dying = CurrentLiveness->Dying;
+  return Reads != CurrentLiveness->Reads.end() && Reads->second == 1 &&
+    std::find(Dying.begin(), Dying.end(), Name) != Dying.end();
+}
 
-    return alloc;
-  } else if (Callee == "sub") {
-    MiniAPLArrayType type = TypeTable[this];
-    const int size = type.Cardinality();
-    auto *vec_type = VectorType::get(intTy(32), size);
+// The buffer an elementwise builtin over `size` elements of Elem stores its
+// result to: a dying contiguous operand (Args[i] evaluated to Vals[i]) of
+// the same type, which is then updated in place, or else one from
+// takeBuffer. Every element is stored after the operands' elements at its
+// index are loaded, so overwriting an operand is safe.
+Value *elementwiseOutput(const int64_t size, Type* Elem, const vector<ASTNode*>& Args,
+    const vector<ArrayView>& Vals) {
+  for (int i = 0; i < (int) Args.size(); i++) {
+    Value *Buffer = Vals[i].Base[0];
+    if (Vals[i].Layout.Segments == 0 && Buffer->getType() == PointerType::get(Elem, 0) &&
+        isDying(Args[i], Buffer)) {
+      CountStat("in_place_updates", 1);
+      return Buffer;
+    }
+  }
+  return takeBuffer(size, Elem);
+}
 
-    Value *arg0 = Args[0]->codegen(F);
-    Value *arg1 = Args[1]->codegen(F);
+Value *elementPtr(Value* array, const int i) {
+  return Builder.CreateGEP(arrayElemTy(array), array, intConst(32, i));
+}
 
-    arg0 = Builder.CreateLoad(vec_type, arg0);
-    arg1 = Builder.CreateLoad(vec_type, arg1);
+// Views the first `size` elements of an array as a single LLVM vector value.
+Value *loadArrayVector(Value* array, const int size) {
+  auto *vec_type = VectorType::get(arrayElemTy(array), size);
+  Value *ptr = Builder.CreateBitCast(array, PointerType::get(vec_type, 0));
+  return Builder.CreateLoad(vec_type, ptr);
+}
 
-    Value *sub = Builder.CreateSub(arg0, arg1);
+void storeArrayVector(Value* vec, Value* array) {
+  Value *ptr = Builder.CreateBitCast(array, PointerType::get(vec->getType(), 0));
+  Builder.CreateStore(vec, ptr);
+}
 
-    auto alloc = Builder.CreateAlloca(vec_type);
-    auto dst = Builder.CreateGEP(alloc, {intConst(32, 0), intConst(32, 0)});
-    Builder.CreateStore(sub, dst);
+// Copies `count` elements from `src` to `dst`.
+void copyElements(Value* DstArray, Value* SrcArray, Value* Count) {
+  const int Bytes = elemBytes(arrayElemTy(DstArray));
+  Value *Total = Builder.CreateMul(Builder.CreateZExt(Count, Type::getInt64Ty(TheContext)),
+      ConstantInt::get(Type::getInt64Ty(TheContext), Bytes));
+  Builder.CreateMemCpy(DstArray, SrcArray, Total, Bytes);
+}
 
-    // codegen_print_array(type.dimensions, sub, m, bb, 0, 0);
-    Value* arg_print = Builder.CreateLoad(vec_type, alloc);
-    codegen_print_array(type.dimensions, arg_print, m, bb, 0, 0);
-    kprintf_str(m, bb, "\n");
+// Converts an element, or a vector of elements, to element type To. Integers
+// are sign extended or truncated.
+Value *convertElements(Value* V, Type* To) {
+  Type *From = V->getType()->getScalarType();
+  if (From == To) {
+    return V;
+  }
+  Type *Target = V->getType()->isVectorTy()
+    ? VectorType::get(To, V->getType()->getVectorNumElements()) : To;
+  if (From->isFloatingPointTy() && To->isFloatingPointTy()) {
+    return Builder.CreateFPCast(V, Target);
+  } else if (From->isFloatingPointTy()) {
+    return Builder.CreateFPToSI(V, Target);
+  } else if (To->isFloatingPointTy()) {
+    return Builder.CreateSIToFP(V, Target);
+  }
+  return Builder.CreateSExtOrTrunc(V, Target);
+}
 
-    return alloc;
+// Arithmetic on elements or vectors of elements of any type. Integer
+// arithmetic wraps around.
+Value *emitAdd(Value* A, Value* B) {
+  return A->getType()->isFPOrFPVectorTy() ? Builder.CreateFAdd(A, B) : Builder.CreateAdd(A, B);
+}
 
-  } else if (Callee == "mkArray") {
-    
-    MiniAPLArrayType type = TypeTable[this];
-    const int size = type.Cardinality(); // 6
-    const int dim_length = type.dimensions.size();
-    auto *vec_type = VectorType::get(intTy(32), size);
-    // printf("dim_length %d\n", dim_length);
-    // printf("tensor size %d\n", size);
-    // printf("Args size %d\n", Args.size());
-    std::vector<Value *> ArgsV;
-    for (unsigned i = 1+dim_length, e = Args.size(); i != e; ++i) {
-      ArgsV.push_back(Args[i]->codegen(F));
-    }
-    
-    auto array_data = Builder.CreateAlloca(vec_type);
-    for (unsigned i = 0; i < ArgsV.size(); ++i) {
-      auto dst = Builder.CreateGEP(array_data, {intConst(32, 0), intConst(32, i)});
-      Builder.CreateStore(ArgsV[i], dst);
-    }
-
-    // codegen_print_array(type.dimensions, array_data, m, bb, 0, 0);
-    
-
-    return array_data;
-  } else if (Callee == "neg") {
-    MiniAPLArrayType type = TypeTable[this];
-    const int size = type.Cardinality();
-    auto *vec_type = VectorType::get(intTy(32), size);
+Value *emitMul(Value* A, Value* B) {
+  return A->getType()->isFPOrFPVectorTy() ? Builder.CreateFMul(A, B) : Builder.CreateMul(A, B);
+}
 
-    Value *arg0 = Args[0]->codegen(F);
+Constant *oneOfType(Type* T) {
+  return T->isFPOrFPVectorTy() ? ConstantFP::get(T, 1.0) : ConstantInt::get(T, 1);
+}
 
-    arg0 = Builder.CreateLoad(vec_type, arg0);
-
-    // // // kprintf_str(m, bb, "[");
-    // // // kprintf_val(m, bb, arg0);
-    // // // kprintf_str(m, bb, "]");
-    // for (unsigned i = 0; i < size; ++i) {
-    //   cout << "i " << i << endl;
-    //   // Value* element_ptr = Builder.CreateGEP(arg0, {intConst(32, 0), intConst(32, i)});
-    //   // Value* element_i = Builder.CreateLoad(element_ptr);
-    //   Value* element_i = Builder.CreateExtractElement(arg0, i);
-    //   // Value* arg_i = Args[i] -> codegen(F);
-    //   kprintf_str(m, bb, "[");
-    //   kprintf_val(m, bb, element_i);
-    //   kprintf_str(m, bb, "]");
-    // }
-
-    Value* neg_ones = Builder.CreateVectorSplat(size, intConst(32, -1));
-    Value* neg_arg0 = Builder.CreateMul(arg0, neg_ones);
-    auto alloc = Builder.CreateAlloca(vec_type);
-    auto dst = Builder.CreateGEP(alloc, {intConst(32, 0), intConst(32, 0)});
-    Builder.CreateStore(neg_arg0, dst);
-
-
-    // codegen_print_array(type.dimensions, alloc, m, bb, 0, 0);
-
-    
-    Value* arg_print = Builder.CreateLoad(vec_type, alloc);
-    codegen_print_array(type.dimensions, arg_print, m, bb, 0, 0);
-    kprintf_str(m, bb, "\n");
-
-    return alloc;
-  } else if (Callee == "exp") {
-    MiniAPLArrayType type = TypeTable[this];
-    const int size = type.Cardinality();
-    auto *vec_type = VectorType::get(intTy(32), size);
-    // auto *int_type = intTy(32);
+// ---------------------------------------------------------------------------
+// Loop codegen helpers
+// ---------------------------------------------------------------------------
 
-    // cout << "size " << size << endl;
+// Bytes of each array processed per iteration by the loops generated for
+// elementwise builtins: 8 i32 lanes, 32 i8 lanes or 4 f64 lanes. The
+// remainder is handled by a scalar tail loop.
+static const int VectorBytes = 32;
 
-    Value *arg0 = Args[0]->codegen(F);
-    // arg0 = Builder.CreateGEP(arg0, {intConst(32, 0), intConst(32, 0)});
-    arg0 = Builder.CreateLoad(vec_type, arg0);
-
-
-    // for (unsigned i = 0; i < size; ++i) {
-    //   cout << "i " << i << endl;
-    //   // Value* element_ptr = Builder.CreateGEP(arg0, {intConst(32, 0), intConst(32, i)});
-    //   // Value* element_i = Builder.CreateLoad(element_ptr);
-    //   Value* element_i = Builder.CreateGEP(arg0, {intConst(32, 0), intConst(32, i)});
-    //   element_i = Builder.CreateLoad(element_i);
-    //   // Value* element_i = Builder.CreateExtractElement(arg0, i);
-    //   element_i->print(llvm::outs());
-    //   std::cout << "\n";
-    //   // // Value* arg_i = Args[i] -> codegen(F);
-    //   // kprintf_str(m, bb, "[");
-    //   // kprintf_val(m, bb, element_i);
-    //   // kprintf_str(m, bb, "]");
-    // }
-
-
-    Value *power = Args[1]->codegen(F);
-
-
-    // Value *res = Builder.CreateExp(arg0, power);
-
-    // power = Builder.CreateLoad(int_type, power);
-
-    Value *base = Args[0]->codegen(F);
-
-    base = Builder.CreateLoad(vec_type, base);
-
-    // how to iterate from 0 to power?
-    Value *StartVal = intConst(32, 0); // ConstantFP::get(TheContext, APFloat(0.0));
-    // Make the new basic block for the loop header, inserting after current
-    // block.
-    Function *TheFunction = Builder.GetInsertBlock()->getParent();
-    BasicBlock *PreheaderBB = Builder.GetInsertBlock();
-    BasicBlock *LoopBB =
-        BasicBlock::Create(TheContext, "loop", TheFunction);
-    string VarName = "i_";
-    string MulName = "exp_";
-    // Insert an explicit fall through from the current block to the LoopBB.
-    Builder.CreateBr(LoopBB);
-
-    // Start insertion in LoopBB.
-    Builder.SetInsertPoint(LoopBB);
-    
+// Number of lanes of element type Elem that fit in VectorBytes.
+int lanesFor(Type* Elem) {
+  return VectorBytes / elemBytes(Elem);
+}
 
-    // Start the PHI node with an entry for Start.
-    PHINode *Variable = Builder.CreatePHI(Type::getInt32Ty(TheContext), 2, VarName);
-    Variable->addIncoming(StartVal, PreheaderBB);
+IntegerType* indexTy() {
+  return Type::getInt64Ty(TheContext);
+}
 
-    Value* ones = Builder.CreateVectorSplat(size, intConst(32, 1));
+ConstantInt* indexConst(const int64_t i) {
+  return ConstantInt::get(indexTy(), i);
+}
 
-    PHINode *Result = Builder.CreatePHI(vec_type, 2, MulName);
-    Result->addIncoming(ones, PreheaderBB);
-    
+// Emits `for (i = Start; i < End; i += Step) Body(i)` at the current insertion
+// point and leaves the builder positioned after the loop. Body may emit
+// control flow of its own.
+void emitLoop(Value* Start, Value* End, const int64_t Step,
+    const std::function<void(Value*)>& Body, const std::string& Name = "loop") {
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  BasicBlock *PreheaderBB = Builder.GetInsertBlock();
+  BasicBlock *HeaderBB = BasicBlock::Create(TheContext, Name, TheFunction);
+  BasicBlock *BodyBB = BasicBlock::Create(TheContext, Name + ".body", TheFunction);
+  BasicBlock *AfterBB = BasicBlock::Create(TheContext, Name + ".end", TheFunction);
+
+  Builder.CreateBr(HeaderBB);
+  Builder.SetInsertPoint(HeaderBB);
+  PHINode *Idx = Builder.CreatePHI(Start->getType(), 2, Name + ".i");
+  Idx->addIncoming(Start, PreheaderBB);
+  Builder.CreateCondBr(Builder.CreateICmpSLT(Idx, End), BodyBB, AfterBB);
+
+  Builder.SetInsertPoint(BodyBB);
+  Body(Idx);
+  Value *Next = Builder.CreateAdd(Idx, ConstantInt::get(Idx->getType(), Step), Name + ".next");
+  Idx->addIncoming(Next, Builder.GetInsertBlock());
+  Builder.CreateBr(HeaderBB);
+
+  Builder.SetInsertPoint(AfterBB);
+}
 
-    // Within the loop, the variable is defined equal to the PHI node.  If it
-    // shadows an existing variable, we have to restore it, so save it now.
-    Value *OldVal = ValueTable[VarName];
-    ValueTable[VarName] = Variable;
+// Like emitLoop, but threads a value through the iterations: Body gets the
+// index and the current value and returns the next one. Returns the value
+// after the last iteration, which is Init if the loop body never runs.
+Value *emitAccumulatingLoop(Value* Start, Value* End, const int64_t Step, Value* Init,
+    const std::function<Value*(Value*, Value*)>& Body, const std::string& Name = "loop") {
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  BasicBlock *PreheaderBB = Builder.GetInsertBlock();
+  BasicBlock *HeaderBB = BasicBlock::Create(TheContext, Name, TheFunction);
+  BasicBlock *BodyBB = BasicBlock::Create(TheContext, Name + ".body", TheFunction);
+  BasicBlock *AfterBB = BasicBlock::Create(TheContext, Name + ".end", TheFunction);
+
+  Builder.CreateBr(HeaderBB);
+  Builder.SetInsertPoint(HeaderBB);
+  PHINode *Idx = Builder.CreatePHI(Start->getType(), 2, Name + ".i");
+  PHINode *Acc = Builder.CreatePHI(Init->getType(), 2, Name + ".acc");
+  Idx->addIncoming(Start, PreheaderBB);
+  Acc->addIncoming(Init, PreheaderBB);
+  Builder.CreateCondBr(Builder.CreateICmpSLT(Idx, End), BodyBB, AfterBB);
+
+  Builder.SetInsertPoint(BodyBB);
+  Value *NextAcc = Body(Idx, Acc);
+  Value *Next = Builder.CreateAdd(Idx, ConstantInt::get(Idx->getType(), Step), Name + ".next");
+  Idx->addIncoming(Next, Builder.GetInsertBlock());
+  Acc->addIncoming(NextAcc, Builder.GetInsertBlock());
+  Builder.CreateBr(HeaderBB);
+
+  Builder.SetInsertPoint(AfterBB);
+  return Acc;
+}
 
-    // Emit the body of the loop.  This, like any other expr, can change the
-    // current BB.  Note that we ignore the value computed by the body, but don't
-    // allow an error.
-    // if (!Body->codegen())
-    //   return nullptr;
-    // arg0 = Builder.CreateMul(arg0, base);
-    // cout << "arg0 " << endl;
-    Value* NextResult = Builder.CreateMul(Result, arg0);
+// Loads/stores `Lanes` consecutive elements starting at index `Idx`. Only
+// element alignment is assumed, so these work at any offset.
+Value *loadLanes(Value* Array, Value* Idx, const int Lanes) {
+  Type *Elem = arrayElemTy(Array);
+  auto *VecTy = VectorType::get(Elem, Lanes);
+  Value *VecPtr = Builder.CreateBitCast(Builder.CreateGEP(Elem, Array, Idx),
+      PointerType::get(VecTy, 0));
+  return Builder.CreateAlignedLoad(VecPtr, elemBytes(Elem));
+}
 
-    Value *StepVal = intConst(32, 1); // ConstantFP::get(TheContext, APFloat(1.0));
-    // // Emit the step value.
-    // Value *StepVal = nullptr;
-    // if (Step) {
-    //   StepVal = Step->codegen();
-    //   if (!StepVal)
-    //     return nullptr;
-    // } else {
-    //   // If not specified, use 1.0.
-    //   StepVal = ConstantFP::get(*TheContext, APFloat(1.0));
-    // }
-
-    Value *NextVar = Builder.CreateAdd(Variable, StepVal, "nextvar");
-
-    // Compute the end condition.
+void storeLanes(Value* Vec, Value* Array, Value* Idx) {
+  Type *Elem = arrayElemTy(Array);
+  Value *VecPtr = Builder.CreateBitCast(Builder.CreateGEP(Elem, Array, Idx),
+      PointerType::get(Vec->getType(), 0));
+  Builder.CreateAlignedStore(Vec, VecPtr, elemBytes(Elem));
+}
 
+// ---------------------------------------------------------------------------
+// Parallel loops
+//
+// Large loops are outlined into a function over an index range, which the
+// runtime's miniapl_parallel_for runs in chunks on its worker pool. Whether a
+// loop is outlined depends only on its size, so the generated code is the
+// same for any number of threads.
+// ---------------------------------------------------------------------------
 
-    // Value *EndCond = Builder.CreateICmpEQ(
-    //     NextVar, power, "loopcond");
+// Elementwise builtins and reductions over fewer elements than this stay
+// serial loops.
+static const int64_t ParallelMinElements = int64_t(1) << 16;
+// Elementwise chunks are multiples of this many elements.
+static const int64_t ElementwiseGrain = int64_t(1) << 13;
+
+// Receives the bounds of a chunk and the captured values as seen inside the
+// outlined function.
+typedef std::function<void(Value*, Value*, const vector<Value*>&)> RangeBody;
+
+// Emits a call running Body over [0, N) with miniapl_parallel_for. Body is
+// generated into a function of its own, so any value from the current
+// function it uses must be passed in Captured; non-constant captured values
+// travel through a context record. Constants are passed through unchanged,
+// so code specialized on them (such as constant powers) stays specialized.
+// N and Grain are i64 values, so they need not be known at compile time.
+void emitParallelFor(Value* N, Value* Grain, const vector<Value*>& Captured,
+    const RangeBody& Body, const std::string& Name) {
+  Function *Outer = Builder.GetInsertBlock()->getParent();
+  vector<Type*> Fields;
+  for (auto *V : Captured) {
+    if (!isa<Constant>(V)) {
+      Fields.push_back(V->getType());
+    }
+  }
+  StructType *CtxTy = StructType::get(TheContext, Fields);
+  IRBuilder<> EntryBuilder(&Outer->getEntryBlock(), Outer->getEntryBlock().begin());
+  Value *Ctx = EntryBuilder.CreateAlloca(CtxTy, nullptr, Name + ".ctx");
+  unsigned Field = 0;
+  for (auto *V : Captured) {
+    if (!isa<Constant>(V)) {
+      Builder.CreateStore(V, Builder.CreateStructGEP(CtxTy, Ctx, Field++));
+    }
+  }
 
-    Value *EndCond = Builder.CreateICmpEQ(
-        NextVar, power, "loopcond");
+  Type *I8PtrTy = Type::getInt8PtrTy(TheContext);
+  FunctionType *RangeTy = FunctionType::get(Type::getVoidTy(TheContext),
+      {I8PtrTy, indexTy(), indexTy()}, false);
+  Function *Range = Function::Create(RangeTy, Function::InternalLinkage, Name, TheModule.get());
+  auto Args = Range->arg_begin();
+  Value *RangeCtx = &*Args++;
+  Value *Begin = &*Args++;
+  Value *End = &*Args++;
+
+  IRBuilderBase::InsertPoint Saved = Builder.saveIP();
+  Builder.SetInsertPoint(BasicBlock::Create(TheContext, "entry", Range));
+  Value *Record = Builder.CreateBitCast(RangeCtx, PointerType::get(CtxTy, 0));
+  vector<Value*> Inner;
+  Field = 0;
+  for (auto *V : Captured) {
+    if (isa<Constant>(V)) {
+      Inner.push_back(V);
+    } else {
+      Inner.push_back(Builder.CreateLoad(Builder.CreateStructGEP(CtxTy, Record, Field++)));
+    }
+  }
+  Body(Begin, End, Inner);
+  Builder.CreateRetVoid();
+  Builder.restoreIP(Saved);
 
-    // kprintf_str(m, LoopBB, "EndCond ");
-    // kprintf_val(m, LoopBB, EndCond);
-    // kprintf_str(m, LoopBB, "\n ");
-    // kprintf_str(m, LoopBB, "NextVar ");
-    // kprintf_val(m, LoopBB, NextVar);
-    // kprintf_str(m, LoopBB, "\n ");
-    // kprintf_str(m, LoopBB, "power ");
-    // kprintf_val(m, LoopBB, power);
-    // kprintf_str(m, LoopBB, "\n ");
-    // kprintf_str(m, LoopBB, "Result ");
-    // kprintf_val(m, LoopBB, Result);
-    // kprintf_str(m, LoopBB, "\n ");
-    // kprintf_str(m, LoopBB, "NextResult ");
-    // kprintf_val(m, LoopBB, NextResult);
-    // kprintf_str(m, LoopBB, "\n ");
+  Function *ParallelFor = runtimeFunction("miniapl_parallel_for", Type::getVoidTy(TheContext),
+      {PointerType::get(RangeTy, 0), I8PtrTy, indexTy(), indexTy()});
+  Builder.CreateCall(ParallelFor, {Range, Builder.CreateBitCast(Ctx, I8PtrTy), N, Grain});
+}
 
-    // if (!EndCond)
-    //   return nullptr;
+void emitParallelFor(const int64_t N, const int64_t Grain, const vector<Value*>& Captured,
+    const RangeBody& Body, const std::string& Name) {
+  emitParallelFor(indexConst(N), indexConst(Grain), Captured, Body, Name);
+}
 
-    // // Convert condition to a bool by comparing non-equal to 0.0.
-    // EndCond = Builder.CreateFCmpOEQ(
-    //     EndCond, ConstantFP::get(*TheContext, APFloat(0.0)), "loopcond");
+// Applied to a vector of lanes per input in the vector loop, and to plain
+// elements in the tail loop. Inputs keep their own element types; Op
+// converts them as needed. The second argument holds the uniform operands
+// (loop invariant i32 values such as exp's power).
+typedef std::function<Value*(const vector<Value*>&, const vector<Value*>&)> ElementwiseOp;
+
+// Emits Out[i] = Op(Inputs[0][i], Inputs[1][i], ...) for Begin <= i < End.
+// The vector loop covers VectorBytes of Out per iteration, so narrow element
+// types get more lanes.
+void emitElementwiseLoops(Value* Begin, Value* End, const vector<Value*>& Inputs, Value* Out,
+    const vector<Value*>& Uniforms, const ElementwiseOp& Op) {
+  Type *OutElem = arrayElemTy(Out);
+  const int Lanes = lanesFor(OutElem);
+  Value *VectorLength = Builder.CreateAnd(Builder.CreateSub(End, Begin), indexConst(-Lanes));
+  Value *VectorEnd = Builder.CreateAdd(Begin, VectorLength);
+
+  emitLoop(Begin, VectorEnd, Lanes, [&](Value* I) {
+    vector<Value*> X;
+    for (auto In : Inputs) {
+      X.push_back(loadLanes(In, I, Lanes));
+    }
+    storeLanes(convertElements(Op(X, Uniforms), OutElem), Out, I);
+  }, "vec");
+  emitLoop(VectorEnd, End, 1, [&](Value* I) {
+    vector<Value*> Elems;
+    for (auto In : Inputs) {
+      Elems.push_back(Builder.CreateLoad(arrayElemTy(In), Builder.CreateGEP(arrayElemTy(In), In, I)));
+    }
+    Builder.CreateStore(convertElements(Op(Elems, Uniforms), OutElem),
+        Builder.CreateGEP(OutElem, Out, I));
+  }, "tail");
+}
 
+// Emits Out[i] = Op(Inputs[0][i], Inputs[1][i], ...) for every i < size and
+// returns Out, which may be one of the inputs. Large arrays are processed in
+// parallel.
+Value *emitElementwise(Value* Out, const int64_t size, const vector<Value*>& Inputs,
+    const vector<Value*>& Uniforms, const ElementwiseOp& Op) {
+  if (size < ParallelMinElements) {
+    emitElementwiseLoops(indexConst(0), indexConst(size), Inputs, Out, Uniforms, Op);
+    return Out;
+  }
 
-    // Create the "after loop" block and insert it.
-    BasicBlock *LoopEndBB = Builder.GetInsertBlock();
-    BasicBlock *AfterBB =
-        BasicBlock::Create(TheContext, "afterloop", TheFunction);
+  vector<Value*> Captured(Inputs);
+  Captured.push_back(Out);
+  Captured.insert(Captured.end(), Uniforms.begin(), Uniforms.end());
+  emitParallelFor(size, ElementwiseGrain, Captured, [&](Value* Begin, Value* End, const vector<Value*>& C) {
+    vector<Value*> InnerInputs(C.begin(), C.begin() + Inputs.size());
+    vector<Value*> InnerUniforms(C.begin() + Inputs.size() + 1, C.end());
+    emitElementwiseLoops(Begin, End, InnerInputs, C[Inputs.size()], InnerUniforms, Op);
+  }, "elementwise");
+  return Out;
+}
 
-    // Insert the conditional branch into the end of LoopEndBB.
-    Builder.CreateCondBr(EndCond, AfterBB, LoopBB);
+// Raises `Base` (an element or a vector of elements) to the compile-time
+// exponent `Power` by left-to-right square-and-multiply: one squaring per
+// bit after the leading one and one extra multiply per set bit, so
+// exp(A, 1000) costs 14 multiplies. Exponents below one yield 1.
+Value *emitConstantPower(Value* Base, const int Power) {
+  if (Power <= 0) {
+    return oneOfType(Base->getType());
+  }
+  int Bit = 30;
+  while (!((Power >> Bit) & 1)) {
+    Bit--;
+  }
+  Value *Result = Base;
+  for (Bit--; Bit >= 0; Bit--) {
+    Result = emitMul(Result, Result);
+    if ((Power >> Bit) & 1) {
+      Result = emitMul(Result, Base);
+    }
+  }
+  return Result;
+}
 
-    // Any new code will be inserted in AfterBB.
-    Builder.SetInsertPoint(AfterBB);
+// Raises `Base` (an element or a vector of elements) to the runtime i32
+// exponent `Power` with a right-to-left binary exponentiation loop that runs
+// once per bit of `Power`. Exponents below one yield 1.
+Value *emitPowerLoop(Value* Base, Value* Power) {
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  BasicBlock *PreheaderBB = Builder.GetInsertBlock();
+  BasicBlock *HeaderBB = BasicBlock::Create(TheContext, "pow", TheFunction);
+  BasicBlock *BodyBB = BasicBlock::Create(TheContext, "pow.body", TheFunction);
+  BasicBlock *AfterBB = BasicBlock::Create(TheContext, "pow.end", TheFunction);
+
+  Builder.CreateBr(HeaderBB);
+  Builder.SetInsertPoint(HeaderBB);
+  PHINode *Exponent = Builder.CreatePHI(intTy(32), 2, "pow.e");
+  PHINode *Square = Builder.CreatePHI(Base->getType(), 2, "pow.sq");
+  PHINode *Result = Builder.CreatePHI(Base->getType(), 2, "pow.acc");
+  Exponent->addIncoming(Power, PreheaderBB);
+  Square->addIncoming(Base, PreheaderBB);
+  Result->addIncoming(oneOfType(Base->getType()), PreheaderBB);
+  Builder.CreateCondBr(Builder.CreateICmpSGT(Exponent, intConst(32, 0)), BodyBB, AfterBB);
+
+  // acc *= sq if the low bit is set; sq *= sq; e >>= 1
+  Builder.SetInsertPoint(BodyBB);
+  Value *LowBit = Builder.CreateICmpNE(Builder.CreateAnd(Exponent, intConst(32, 1)), intConst(32, 0));
+  Result->addIncoming(Builder.CreateSelect(LowBit, emitMul(Result, Square), Result), BodyBB);
+  Square->addIncoming(emitMul(Square, Square), BodyBB);
+  Exponent->addIncoming(Builder.CreateLShr(Exponent, intConst(32, 1)), BodyBB);
+  Builder.CreateBr(HeaderBB);
+
+  Builder.SetInsertPoint(AfterBB);
+  return Result;
+}
 
+// Applies one elementwise builtin to lanes or scalar elements of its array
+// operands, computing in element type Elem; operands of other types are
+// converted first. `Power` is the already evaluated exponent of exp.
+Value *emitElementwiseOp(const std::string& Callee, const vector<Value*>& Operands, Value* Power,
+    Type* Elem) {
+  vector<Value*> X;
+  for (auto *V : Operands) {
+    X.push_back(convertElements(V, Elem));
+  }
+  const bool Float = Elem->isFloatingPointTy();
+  if (Callee == "add") {
+    return Float ? Builder.CreateFAdd(X[0], X[1]) : Builder.CreateAdd(X[0], X[1]);
+  } else if (Callee == "sub") {
+    return Float ? Builder.CreateFSub(X[0], X[1]) : Builder.CreateSub(X[0], X[1]);
+  } else if (Callee == "neg") {
+    return Float ? Builder.CreateFNeg(X[0]) : Builder.CreateNeg(X[0]);
+  }
+  assert(Callee == "exp");
+  // Literal powers (the common case) get a fixed multiply sequence.
+  if (auto *C = dyn_cast<ConstantInt>(Power)) {
+    return emitConstantPower(X[0], C->getSExtValue());
+  }
+  return emitPowerLoop(X[0], Power);
+}
 
-    
-    
+// Evaluates exp's power argument to an i32. A one element array of any
+// element type also works.
+Value *codegenPower(ASTNode* PowerArg, Function* F) {
+  Value *Power = PowerArg->codegen(F);
+  if (Power->getType()->isPointerTy()) {
+    Power = convertElements(Builder.CreateLoad(arrayElemTy(Power), Power), intTy(32));
+  }
+  return Power;
+}
 
+// Sums the lanes of a vector.
+Value *horizontalAdd(Value* Vec) {
+  const unsigned Lanes = Vec->getType()->getVectorNumElements();
+  Value *Sum = Builder.CreateExtractElement(Vec, (uint64_t) 0);
+  for (unsigned i = 1; i < Lanes; i++) {
+    Sum = emitAdd(Sum, Builder.CreateExtractElement(Vec, (uint64_t) i));
+  }
+  return Sum;
+}
 
-    // Add a new entry to the PHI node for the backedge.
-    Variable->addIncoming(NextVar, LoopEndBB);
-    Result->addIncoming(NextResult, LoopEndBB);
+// Lanes of the accumulator used for sums of Elem: several vectors' worth, so
+// the adds of consecutive iterations are independent and can overlap.
+int sumLanes(Type* Elem) {
+  return 4 * lanesFor(Elem);
+}
 
-    // Restore the unshadowed variable.
-    if (OldVal)
-      ValueTable[VarName] = OldVal;
-    else
-      ValueTable.erase(VarName);
+// Emits the sum of the `Length` elements of Src starting at `Start` (both
+// i64), using sumLanes partial sums that are combined at the end, plus a
+// scalar tail. The sum has Src's element type. The order of the additions
+// depends only on Length, so floating point sums are reproducible.
+Value *emitSum(Value* Src, Value* Start, Value* Length) {
+  Type *Elem = arrayElemTy(Src);
+  const int SumLanes = sumLanes(Elem);
+  Value *VectorEnd = Builder.CreateAnd(Length, indexConst(-SumLanes));
+  Value *Sum = Constant::getNullValue(Elem);
+  auto *ConstEnd = dyn_cast<ConstantInt>(VectorEnd);
+  if (!ConstEnd || !ConstEnd->isZero()) {
+    Value *Zero = Constant::getNullValue(VectorType::get(Elem, SumLanes));
+    Value *Partial = emitAccumulatingLoop(indexConst(0), VectorEnd, SumLanes, Zero,
+        [&](Value* J, Value* Acc) {
+          return emitAdd(Acc, loadLanes(Src, Builder.CreateAdd(Start, J), SumLanes));
+        }, "sumvec");
+    Sum = horizontalAdd(Partial);
+  }
+  if (!ConstEnd || ConstEnd != Length) {
+    Sum = emitAccumulatingLoop(VectorEnd, Length, 1, Sum,
+        [&](Value* J, Value* Acc) {
+          Value *E = Builder.CreateLoad(Elem,
+              Builder.CreateGEP(Elem, Src, Builder.CreateAdd(Start, J)));
+          return emitAdd(Acc, E);
+        }, "sumtail");
+  }
+  return Sum;
+}
 
+// Rows at least twice this long are summed in blocks of this many elements,
+// so that a few long rows still spread over all threads.
+static const int64_t ReduceBlockElements = int64_t(1) << 15;
+
+// Emits Out[r] = Src[r * cols] + ... + Src[r * cols + cols - 1] for every
+// r < rows into a new array. Large reductions run in parallel: over rows
+// when they are short, and over fixed blocks of each row otherwise, whose
+// partial sums are then added up pairwise in a fixed tree order. Block
+// boundaries depend only on the shape, never on the number of threads.
+Value *emitRowSums(Value* Src, const int64_t rows, const int64_t cols) {
+  Type *Elem = arrayElemTy(Src);
+  Value *Out = takeBuffer(rows, Elem);
+  auto SumRows = [&](Value* In, Value* Sums, Value* Begin, Value* End) {
+    emitLoop(Begin, End, 1, [&](Value* R) {
+      Value *Sum = emitSum(In, Builder.CreateMul(R, indexConst(cols)), indexConst(cols));
+      Builder.CreateStore(Sum, Builder.CreateGEP(Elem, Sums, R));
+    }, "row");
+  };
+
+  if (rows * cols < ParallelMinElements) {
+    SumRows(Src, Out, indexConst(0), indexConst(rows));
+    return Out;
+  }
+  if (cols < 2 * ReduceBlockElements) {
+    const int64_t Grain = std::max(ElementwiseGrain / cols, (int64_t) 1);
+    emitParallelFor(rows, Grain, {Src, Out}, [&](Value* Begin, Value* End, const vector<Value*>& C) {
+      SumRows(C[0], C[1], Begin, End);
+    }, "reduce");
+    return Out;
+  }
 
-    // Value* pp = Builder.CreateMul(arg0, arg0);
+  // One partial sum per block, computed in parallel.
+  const int64_t Blocks = (cols + ReduceBlockElements - 1) / ReduceBlockElements;
+  Value *Partials = takeBuffer(rows * Blocks, Elem);
+  emitParallelFor(rows * Blocks, 1, {Src, Partials}, [&](Value* Begin, Value* End, const vector<Value*>& C) {
+    emitLoop(Begin, End, 1, [&](Value* T) {
+      Value *R = Builder.CreateSDiv(T, indexConst(Blocks));
+      Value *Offset = Builder.CreateMul(Builder.CreateSRem(T, indexConst(Blocks)),
+          indexConst(ReduceBlockElements));
+      Value *Remaining = Builder.CreateSub(indexConst(cols), Offset);
+      Value *Length = Builder.CreateSelect(
+          Builder.CreateICmpSLT(Remaining, indexConst(ReduceBlockElements)),
+          Remaining, indexConst(ReduceBlockElements));
+      Value *Start = Builder.CreateAdd(Builder.CreateMul(R, indexConst(cols)), Offset);
+      Builder.CreateStore(emitSum(C[0], Start, Length), Builder.CreateGEP(Elem, C[1], T));
+    }, "block");
+  }, "reduce");
+
+  // Add up each row's partial sums pairwise: P[b] += P[b + stride] for
+  // strides 1, 2, 4, ... leaves the row's sum in P[0].
+  emitLoop(indexConst(0), indexConst(rows), 1, [&](Value* R) {
+    Value *Row = Builder.CreateGEP(Elem, Partials, Builder.CreateMul(R, indexConst(Blocks)));
+    for (int64_t Stride = 1; Stride < Blocks; Stride *= 2) {
+      emitLoop(indexConst(0), indexConst(Blocks - Stride), 2 * Stride, [&](Value* B) {
+        Value *Dst = Builder.CreateGEP(Elem, Row, B);
+        Value *Other = Builder.CreateGEP(Elem, Row, Builder.CreateAdd(B, indexConst(Stride)));
+        Builder.CreateStore(emitAdd(Builder.CreateLoad(Elem, Dst),
+            Builder.CreateLoad(Elem, Other)), Dst);
+      }, "combine");
+    }
+    Builder.CreateStore(Builder.CreateLoad(Elem, Row), Builder.CreateGEP(Elem, Out, R));
+  }, "rowsum");
+  releaseBuffer(Partials);
+  return Out;
+}
 
-    
+// ---------------------------------------------------------------------------
+// Kernel library
+//
+// With --kernels, elementwise builtins, fused chains and reductions over
+// large contiguous arrays call a kernel generated once per operation,
+// element types and rank, which reads the dimensions from a shape array at
+// runtime. Compile time then grows with the number of distinct operations
+// rather than with the number of call sites. Arrays of fewer than
+// KernelMinElements elements, views and reductions of long rows keep code
+// specialized on their shape, where constant trip counts pay off most.
+// ---------------------------------------------------------------------------
+static const int64_t KernelMinElements = int64_t(1) << 12;
+
+// Kernels generated into the current module, by name.
+static unordered_map<string, Function*> ModuleKernels;
+// In the REPL every statement is a module of its own. Kernels are then
+// external, and those compiled with an earlier statement are only declared;
+// the JIT resolves them to the earlier definition. Kernels defined in the
+// current module only count as compiled once it has been added to the JIT.
+static bool ShareKernels = false;
+static std::set<string> JitKernels;
+static vector<string> PendingKernels;
+
+void ResetKernels() {
+  ModuleKernels.clear();
+  PendingKernels.clear();
+}
 
-    // // for expr always returns 0.0.
-    // return Constant::getNullValue(Type::getDoubleTy(*TheContext));
+// Called once the current module is in the JIT: later modules can use its
+// kernels.
+void CommitKernels() {
+  JitKernels.insert(PendingKernels.begin(), PendingKernels.end());
+  PendingKernels.clear();
+}
 
-    // Value* arg0_ = Builder.CreateMul(arg0, arg0);
+// True if an operation over Size contiguous elements should call a kernel.
+bool useKernel(const int64_t Size) {
+  return KernelLibrary && Size >= KernelMinElements;
+}
 
+// Name of element type Elem in kernel names.
+string typeName(Type* Elem) {
+  string Name;
+  raw_string_ostream Stream(Name);
+  Elem->print(Stream);
+  return Stream.str();
+}
 
-    // arg0 = Builder.CreateMul(arg0, base);
-    auto alloc = Builder.CreateAlloca(vec_type);
-    auto dst = Builder.CreateGEP(alloc, {intConst(32, 0), intConst(32, 0)});
-    Builder.CreateStore(NextResult, dst);
+// Returns the kernel Name of type FT. The first time it is used in a module
+// its body is generated by Body, given the kernel's arguments.
+Function *libraryKernel(const string& Name, FunctionType* FT,
+    const std::function<void(const vector<Value*>&)>& Body) {
+  auto K = ModuleKernels.find(Name);
+  if (K != ModuleKernels.end()) {
+    return K->second;
+  }
+  Function *Kernel = Function::Create(FT,
+      ShareKernels ? Function::ExternalLinkage : Function::InternalLinkage, Name, TheModule.get());
+  ModuleKernels[Name] = Kernel;
+  if (ShareKernels && JitKernels.count(Name)) {
+    return Kernel;
+  }
 
-    // // // codegen_print_array(type.dimensions, alloc, m, bb, 0, 0);
-    Value* arg_print = Builder.CreateLoad(vec_type, alloc);
-    codegen_print_array(type.dimensions, arg_print, m, AfterBB, 0, 0);
-    kprintf_str(m, AfterBB, "\n");
+  // Inlining would specialize the kernel on every call site again.
+  Kernel->addFnAttr(Attribute::NoInline);
+  vector<Value*> Args;
+  for (auto& A : Kernel->args()) {
+    Args.push_back(&A);
+  }
+  IRBuilderBase::InsertPoint Saved = Builder.saveIP();
+  Builder.SetInsertPoint(BasicBlock::Create(TheContext, "entry", Kernel));
+  Body(Args);
+  Builder.CreateRetVoid();
+  Builder.restoreIP(Saved);
+  if (ShareKernels) {
+    PendingKernels.push_back(Name);
+  }
+  CountStat("library_kernels", 1);
+  return Kernel;
+}
 
-    // // Value* resultVector = Result;
+// Emits the product of Dims[Begin], ..., Dims[End - 1], for the i64* shape
+// Dims.
+Value *shapeProduct(Value* Dims, const int Begin, const int End) {
+  Value *Product = indexConst(1);
+  for (int d = Begin; d < End; d++) {
+    Value *Dim = Builder.CreateLoad(indexTy(), Builder.CreateGEP(indexTy(), Dims, indexConst(d)));
+    Product = Builder.CreateMul(Product, Dim);
+  }
+  return Product;
+}
 
-    // BasicBlock *bb = Builder.GetInsertBlock();
-    // // Module *m = TheModule.get();
-    // for (unsigned i = 0; i < size; ++i) {
-    //   cout << "i " << i << endl;
-    //   // Value* element_ptr = Builder.CreateGEP(arg_print, {intConst(32, 0), intConst(32, i)});
-    //   // Value* element_i = Builder.CreateLoad(element_ptr);
-    //   // Value* element_i = Builder.CreateGEP(alloc, {intConst(32, 0), intConst(32, i)});
-    //   // element_i = Builder.CreateLoad(element_i);
-    //   Value* element_i = Builder.CreateExtractElement(arg_print, i);
-    //   // element_i->print(llvm::outs());
-    //   // std::cout << "\n";
-    //   // // Value* arg_i = Args[i] -> codegen(F);
-    //   kprintf_str(m, AfterBB, "[");
-    //   kprintf_val(m, AfterBB, element_i);
-    //   kprintf_str(m, AfterBB, "]");
-    // }
-    
+// The grain for miniapl_parallel_for over N items of Work elements each
+// that makes it run serially below ParallelMinElements elements, as the
+// specialized code does.
+Value *kernelGrain(Value* N, Value* Work, Value* Grain) {
+  Value *Serial = Builder.CreateICmpSLT(Builder.CreateMul(N, Work), indexConst(ParallelMinElements));
+  return Builder.CreateSelect(Serial, N, Grain);
+}
 
+Value *shapeConstant(const vector<int>& dims);
+
+// Emits Out[i] = Op(Inputs[0][i], Inputs[1][i], ...) over the contiguous
+// arrays of shape Dims as a call to the kernel for operation Key. Key must
+// name everything Op computes other than the element types of Out and
+// Inputs, which are part of the kernel's name.
+void emitElementwiseKernel(const string& Key, Value* Out, const vector<int>& Dims,
+    const vector<Value*>& Inputs, const vector<Value*>& Uniforms, const ElementwiseOp& Op) {
+  string Name = "miniapl.kernel." + Key + "." + typeName(arrayElemTy(Out));
+  vector<Type*> Params = {Out->getType()};
+  for (auto *In : Inputs) {
+    Name += "." + typeName(arrayElemTy(In));
+    Params.push_back(In->getType());
+  }
+  for (auto *U : Uniforms) {
+    Params.push_back(U->getType());
+  }
+  Name += ".r" + str(Dims.size());
+  Params.push_back(PointerType::get(indexTy(), 0));
+  FunctionType *FT = FunctionType::get(Type::getVoidTy(TheContext), Params, false);
+
+  const int NumInputs = Inputs.size();
+  Function *Kernel = libraryKernel(Name, FT, [&](const vector<Value*>& A) {
+    Value *Size = shapeProduct(A.back(), 0, Dims.size());
+    vector<Value*> Captured(A.begin() + 1, A.end() - 1);
+    Captured.push_back(A[0]);
+    emitParallelFor(Size, kernelGrain(Size, indexConst(1), indexConst(ElementwiseGrain)), Captured,
+        [&](Value* Begin, Value* End, const vector<Value*>& C) {
+          vector<Value*> InnerInputs(C.begin(), C.begin() + NumInputs);
+          vector<Value*> InnerUniforms(C.begin() + NumInputs, C.end() - 1);
+          emitElementwiseLoops(Begin, End, InnerInputs, C.back(), InnerUniforms, Op);
+        }, "elementwise");
+  });
+
+  vector<Value*> CallArgs = {Out};
+  CallArgs.insert(CallArgs.end(), Inputs.begin(), Inputs.end());
+  CallArgs.insert(CallArgs.end(), Uniforms.begin(), Uniforms.end());
+  CallArgs.push_back(shapeConstant(Dims));
+  Builder.CreateCall(Kernel, CallArgs);
+  CountStat("kernel_calls", 1);
+}
 
+// Row sums of the contiguous array Src of shape Dims into a new array, as a
+// call to the reduce kernel. Gives the same sums as emitRowSums for rows
+// shorter than 2 * ReduceBlockElements, which is all it is used for.
+Value *emitRowSumsKernel(Value* Src, const vector<int>& Dims) {
+  Type *Elem = arrayElemTy(Src);
+  const int Rank = Dims.size();
+  int64_t Rows = 1;
+  for (int d = 0; d + 1 < Rank; d++) {
+    Rows *= Dims[d];
+  }
+  Value *Out = takeBuffer(Rows, Elem);
+  const string Name = "miniapl.kernel.reduce." + typeName(Elem) + ".r" + str(Rank);
+  FunctionType *FT = FunctionType::get(Type::getVoidTy(TheContext),
+      {Src->getType(), Out->getType(), PointerType::get(indexTy(), 0)}, false);
+  Function *Kernel = libraryKernel(Name, FT, [&](const vector<Value*>& A) {
+    Value *NumRows = shapeProduct(A[2], 0, Rank - 1);
+    Value *Cols = shapeProduct(A[2], Rank - 1, Rank);
+    Value *Grain = Builder.CreateSDiv(indexConst(ElementwiseGrain), Cols);
+    Grain = Builder.CreateSelect(Builder.CreateICmpSLT(Grain, indexConst(1)), indexConst(1), Grain);
+    emitParallelFor(NumRows, kernelGrain(NumRows, Cols, Grain), {A[0], A[1], Cols},
+        [&](Value* Begin, Value* End, const vector<Value*>& C) {
+          emitLoop(Begin, End, 1, [&](Value* R) {
+            Value *Sum = emitSum(C[0], Builder.CreateMul(R, C[2]), C[2]);
+            Builder.CreateStore(Sum, Builder.CreateGEP(Elem, C[1], R));
+          }, "row");
+        }, "reduce");
+  });
+  Builder.CreateCall(Kernel, {Src, Out, shapeConstant(Dims)});
+  CountStat("kernel_calls", 1);
+  return Out;
+}
 
-    return alloc;
+// ---------------------------------------------------------------------------
+// Array views
+//
+// expand and concat do not copy: their result is a view (see ArrayLayout)
+// read by the builtins that consume it. Every row of a view (its innermost
+// dimension) consists of at most a few contiguous runs of its buffers, so
+// loops over views go row by row and within a row over column ranges in
+// which every operand is contiguous, reusing the loops for contiguous
+// arrays. Views are only copied into a buffer (materialized) when an array
+// must be contiguous, as for print, store and the results of REPL
+// statements.
+// ---------------------------------------------------------------------------
 
+vector<int64_t> rowMajorStrides(const vector<int>& Dims) {
+  vector<int64_t> Strides(Dims.size());
+  int64_t Stride = 1;
+  for (int d = (int) Dims.size() - 1; d >= 0; d--) {
+    Strides[d] = Stride;
+    Stride *= Dims[d];
+  }
+  return Strides;
+}
 
+// Layout with explicit strides: a contiguous array becomes a one segment view
+// of its buffer.
+ArrayLayout explicitLayout(const ArrayLayout& Layout, const vector<int>& Dims) {
+  if (Layout.Segments > 0) {
+    return Layout;
+  }
+  ArrayLayout L = Layout;
+  L.Segments = 1;
+  L.Strides[0] = rowMajorStrides(Dims);
+  L.Offset[0] = 0;
+  return L;
+}
 
+bool sameView(const ArrayView& A, const ArrayView& B) {
+  const ArrayLayout& L = A.Layout;
+  const ArrayLayout& M = B.Layout;
+  if (A.Base[0] != B.Base[0] || A.Base[1] != B.Base[1] || L.Segments != M.Segments) {
+    return false;
+  }
+  for (int s = 0; s < L.Segments; s++) {
+    if (L.Strides[s] != M.Strides[s] || L.Offset[s] != M.Offset[s]) {
+      return false;
+    }
+  }
+  return L.Segments < 2 || (L.SplitDim == M.SplitDim && L.Split == M.Split);
+}
 
-    // Value* ones = Builder.CreateVectorSplat(size, intConst(32, -1));
-    // Value* neg_arg0 = Builder.CreateMul(arg0, ones);
+// expand(In, n) as a view: the new dimension before the innermost one has
+// stride 0.
+ArrayView expandView(const ArrayView& In, const vector<int>& InDims) {
+  ArrayView V = In;
+  V.Layout = explicitLayout(In.Layout, InDims);
+  const int Rank = InDims.size();
+  for (int s = 0; s < V.Layout.Segments; s++) {
+    auto& Strides = V.Layout.Strides[s];
+    Strides.insert(Strides.end() - 1, 0);
+  }
+  if (V.Layout.Segments == 2 && V.Layout.SplitDim == Rank - 1) {
+    V.Layout.SplitDim = Rank;
+  }
+  return V;
+}
 
-    // auto alloc = Builder.CreateAlloca(vec_type);
-    // auto dst = Builder.CreateGEP(alloc, {intConst(32, 0), intConst(32, 0)});
-    // // auto ptr_type = PointerType::get(vec_type, 0);
-    // // Value* dst = Builder.CreatePointerCast(alloc, ptr_type);
-    // Builder.CreateStore(neg_arg0, dst);
-    // // std::cout << "here 2\n";
-
-
-    // // codegen_print_array(type.dimensions, alloc, m, bb, 0, 0);
+// concat(A, B, Dim) as a two segment view. A and B must be one segment views
+// or contiguous.
+ArrayView concatView(const ArrayView& A, const vector<int>& ADims, const ArrayView& B,
+    const vector<int>& BDims, const int Dim) {
+  ArrayLayout LA = explicitLayout(A.Layout, ADims);
+  ArrayLayout LB = explicitLayout(B.Layout, BDims);
+  ArrayView V = {{A.Base[0], B.Base[0]}};
+  V.Layout.Segments = 2;
+  V.Layout.Strides[0] = LA.Strides[0];
+  V.Layout.Offset[0] = LA.Offset[0];
+  // Segment 1 starts at index ADims[Dim] of dimension Dim.
+  V.Layout.Strides[1] = LB.Strides[0];
+  V.Layout.Offset[1] = LB.Offset[0] - ADims[Dim] * LB.Strides[0][Dim];
+  V.Layout.SplitDim = Dim;
+  V.Layout.Split = ADims[Dim];
+  return V;
+}
 
-    // return alloc;
-  } else if (Callee == "print") {
-    MiniAPLArrayType type = TypeTable[this];
-    const int size = type.Cardinality();
-    auto *vec_type = VectorType::get(intTy(32), size);
+// Indices of row `Row` in every dimension but the innermost one.
+vector<Value*> rowIndices(Value* Row, const vector<int>& Dims) {
+  vector<Value*> Idx(Dims.size() - 1);
+  Value *Rest = Row;
+  for (int d = (int) Dims.size() - 2; d >= 0; d--) {
+    Idx[d] = Builder.CreateSRem(Rest, indexConst(Dims[d]));
+    Rest = Builder.CreateSDiv(Rest, indexConst(Dims[d]));
+  }
+  return Idx;
+}
 
-    Value *arg0 = Args[0]->codegen(F);
+// Returns P such that P[c] is the element of V in the row with indices Idx
+// and column c, for the columns of the range containing Column (see
+// viewColumnRanges).
+Value *viewRowPointer(const ArrayView& V, const vector<Value*>& Idx, const int64_t Column) {
+  const ArrayLayout& L = V.Layout;
+  auto SegmentRow = [&](int s) {
+    Value *Start = indexConst(L.Offset[s]);
+    for (int d = 0; d < (int) Idx.size(); d++) {
+      if (L.Strides[s][d] != 0) {
+        Start = Builder.CreateAdd(Start, Builder.CreateMul(Idx[d], indexConst(L.Strides[s][d])));
+      }
+    }
+    return Builder.CreateGEP(arrayElemTy(V.Base[s]), V.Base[s], Start);
+  };
+  if (L.Segments < 2) {
+    return SegmentRow(0);
+  } else if (L.SplitDim == (int) Idx.size()) {
+    return SegmentRow(Column >= L.Split ? 1 : 0);
+  }
+  return Builder.CreateSelect(Builder.CreateICmpSGE(Idx[L.SplitDim], indexConst(L.Split)),
+      SegmentRow(1), SegmentRow(0));
+}
 
-    arg0 = Builder.CreateLoad(vec_type, arg0);
+// Bounds of the column ranges of rows of length Columns in which each of
+// the views reads a single segment: the views split along the innermost
+// dimension split rows.
+vector<int64_t> viewColumnRanges(const vector<ArrayView>& Views, const int Rank, const int64_t Columns) {
+  vector<int64_t> Bounds = {0, Columns};
+  for (auto& V : Views) {
+    if (V.Layout.Segments == 2 && V.Layout.SplitDim == Rank - 1) {
+      Bounds.push_back(V.Layout.Split);
+    }
+  }
+  std::sort(Bounds.begin(), Bounds.end());
+  Bounds.erase(std::unique(Bounds.begin(), Bounds.end()), Bounds.end());
+  return Bounds;
+}
 
-    // // // kprintf_str(m, bb, "[");
-    // // // kprintf_val(m, bb, arg0);
-    // // // kprintf_str(m, bb, "]");
-    // for (unsigned i = 0; i < size; ++i) {
-    //   cout << "i " << i << endl;
-    //   // Value* element_ptr = Builder.CreateGEP(arg0, {intConst(32, 0), intConst(32, i)});
-    //   // Value* element_i = Builder.CreateLoad(element_ptr);
-    //   Value* element_i = Builder.CreateExtractElement(arg0, i);
-    //   // Value* arg_i = Args[i] -> codegen(F);
-    //   kprintf_str(m, bb, "[");
-    //   kprintf_val(m, bb, element_i);
-    //   kprintf_str(m, bb, "]");
-    // }
+// Runs Body over the rows of an array of shape Dims with operands Views,
+// in parallel when there are at least MinElements elements. Body gets the
+// bounds of a range of rows, the views and the extra values as seen where
+// it runs.
+void emitRowLoops(const vector<int>& Dims, const vector<ArrayView>& Views, const vector<Value*>& Extra,
+    const int64_t MinElements, const std::function<void(Value*, Value*, const vector<ArrayView>&,
+      const vector<Value*>&)>& Body, const std::string& Name) {
+  int64_t Size = 1;
+  for (auto D : Dims) {
+    Size *= D;
+  }
+  const int64_t Columns = Dims.back();
+  const int64_t Rows = Size / Columns;
+  if (Size < MinElements) {
+    Body(indexConst(0), indexConst(Rows), Views, Extra);
+    return;
+  }
 
-    // Value* neg_ones = Builder.CreateVectorSplat(size, intConst(32, -1));
-    // Value* neg_arg0 = Builder.CreateMul(arg0, neg_ones);
-    // auto alloc = Builder.CreateAlloca(vec_type);
-    // auto dst = Builder.CreateGEP(alloc, {intConst(32, 0), intConst(32, 0)});
-    // Builder.CreateStore(neg_arg0, dst);
+  vector<Value*> Captured;
+  for (auto& V : Views) {
+    Captured.push_back(V.Base[0]);
+    if (V.Layout.Segments == 2) {
+      Captured.push_back(V.Base[1]);
+    }
+  }
+  Captured.insert(Captured.end(), Extra.begin(), Extra.end());
+  const int64_t Grain = std::max(ElementwiseGrain / Columns, (int64_t) 1);
+  emitParallelFor(Rows, Grain, Captured, [&](Value* Begin, Value* End, const vector<Value*>& C) {
+    vector<ArrayView> InnerViews(Views);
+    int Next = 0;
+    for (auto& V : InnerViews) {
+      V.Base[0] = C[Next++];
+      if (V.Layout.Segments == 2) {
+        V.Base[1] = C[Next++];
+      }
+    }
+    vector<Value*> InnerExtra(C.begin() + Next, C.end());
+    Body(Begin, End, InnerViews, InnerExtra);
+  }, Name);
+}
 
+// Like emitElementwise, for inputs that may be views. Out is contiguous.
+// Kernel, if given, is the key of the library kernel computing Op (see
+// emitElementwiseKernel).
+void emitElementwiseViews(Value* Out, const vector<int>& Dims, const vector<ArrayView>& Inputs,
+    const vector<Value*>& Uniforms, const ElementwiseOp& Op, const string& Kernel = "") {
+  int64_t Size = 1;
+  for (auto D : Dims) {
+    Size *= D;
+  }
+  bool Contiguous = true;
+  vector<Value*> Buffers;
+  for (auto& V : Inputs) {
+    Contiguous &= V.Layout.Segments == 0;
+    Buffers.push_back(V.Base[0]);
+  }
+  if (Contiguous && !Kernel.empty() && useKernel(Size)) {
+    emitElementwiseKernel(Kernel, Out, Dims, Buffers, Uniforms, Op);
+    return;
+  } else if (Contiguous) {
+    emitElementwise(Out, Size, Buffers, Uniforms, Op);
+    return;
+  }
 
-    // // codegen_print_array(type.dimensions, alloc, m, bb, 0, 0);
+  // Contiguous inputs are read row by row like the views, through explicit
+  // strides.
+  vector<ArrayView> Strided(Inputs);
+  for (auto& V : Strided) {
+    V.Layout = explicitLayout(V.Layout, Dims);
+  }
+  const int Rank = Dims.size();
+  const int64_t Columns = Dims.back();
+  const vector<int64_t> Bounds = viewColumnRanges(Strided, Rank, Columns);
+  vector<Value*> Extra = {Out};
+  Extra.insert(Extra.end(), Uniforms.begin(), Uniforms.end());
+  emitRowLoops(Dims, Strided, Extra, ParallelMinElements,
+      [&](Value* Begin, Value* End, const vector<ArrayView>& Views, const vector<Value*>& X) {
+        Value *Dst = X[0];
+        vector<Value*> U(X.begin() + 1, X.end());
+        emitLoop(Begin, End, 1, [&](Value* Row) {
+          vector<Value*> Idx = rowIndices(Row, Dims);
+          Value *DstRow = Builder.CreateGEP(arrayElemTy(Dst), Dst,
+              Builder.CreateMul(Row, indexConst(Columns)));
+          for (int r = 0; r + 1 < (int) Bounds.size(); r++) {
+            vector<Value*> Rows;
+            for (auto& V : Views) {
+              Rows.push_back(viewRowPointer(V, Idx, Bounds[r]));
+            }
+            emitElementwiseLoops(indexConst(Bounds[r]), indexConst(Bounds[r + 1]), Rows, DstRow, U, Op);
+          }
+        }, "viewrow");
+      }, "elementwise");
+}
 
-    
-    // Value* arg_print = Builder.CreateLoad(vec_type, alloc);
-    codegen_print_array(type.dimensions, arg0, m, bb, 0, 0);
-    kprintf_str(m, bb, "\n");
+// Row sums of the view In of shape Dims into a new array, as emitRowSums
+// does for contiguous arrays. Rows are summed in parallel when there are
+// enough of them; a row is always summed by one thread.
+Value *emitViewRowSums(const ArrayView& In, const vector<int>& Dims) {
+  Type *Elem = arrayElemTy(In.Base[0]);
+  int64_t Size = 1;
+  for (auto D : Dims) {
+    Size *= D;
+  }
+  const int Rank = Dims.size();
+  const int64_t Columns = Dims.back();
+  Value *Out = takeBuffer(Size / Columns, Elem);
+  const vector<int64_t> Bounds = viewColumnRanges({In}, Rank, Columns);
+  emitRowLoops(Dims, {In}, {Out}, ParallelMinElements,
+      [&](Value* Begin, Value* End, const vector<ArrayView>& Views, const vector<Value*>& X) {
+        emitLoop(Begin, End, 1, [&](Value* Row) {
+          vector<Value*> Idx = rowIndices(Row, Dims);
+          Value *Sum = nullptr;
+          for (int r = 0; r + 1 < (int) Bounds.size(); r++) {
+            Value *Part = emitSum(viewRowPointer(Views[0], Idx, Bounds[r]), indexConst(Bounds[r]),
+                indexConst(Bounds[r + 1] - Bounds[r]));
+            Sum = Sum ? emitAdd(Sum, Part) : Part;
+          }
+          Builder.CreateStore(Sum, Builder.CreateGEP(Elem, X[0], Row));
+        }, "viewrow");
+      }, "reduce");
+  return Out;
+}
 
-    return nullptr;
-  } else if (Callee == "reduce") {
-    // reduce(<array>)` - Turn an N dimensional array into an N-1 dimensional array by adding up all numbers in the innermost dimension
+// Copies the view V of shape Dims into Out if V concatenates two contiguous
+// arrays of Out's element type. Out then consists of alternating runs of
+// elements of each operand, one pair per index of the dimensions before the
+// concatenated one, and each run is copied with a single memcpy. Returns
+// false, emitting nothing, for other views.
+bool emitConcatCopy(Value* Out, const ArrayView& V, const vector<int>& Dims) {
+  const ArrayLayout& L = V.Layout;
+  Type *Elem = arrayElemTy(Out);
+  if (L.Segments != 2 || arrayElemTy(V.Base[0]) != Elem || arrayElemTy(V.Base[1]) != Elem) {
+    return false;
+  }
+  vector<int> ADims(Dims);
+  vector<int> BDims(Dims);
+  ADims[L.SplitDim] = L.Split;
+  BDims[L.SplitDim] -= L.Split;
+  const vector<int64_t> BStrides = rowMajorStrides(BDims);
+  const int64_t Inner = BStrides[L.SplitDim];
+  if (L.Offset[0] != 0 || L.Strides[0] != rowMajorStrides(ADims) ||
+      L.Strides[1] != BStrides || L.Offset[1] != -L.Split * Inner) {
+    return false;
+  }
 
-    MiniAPLArrayType type = TypeTable[this];
-    const int size = type.Cardinality();
-    auto *vec_type = VectorType::get(intTy(32), size);
-    auto innermost = type.innermost_dimension;
-    auto *original_vec_type = VectorType::get(intTy(32), size * innermost);
+  int64_t Runs = 1;
+  for (int d = 0; d < L.SplitDim; d++) {
+    Runs *= Dims[d];
+  }
+  const int64_t Run0 = L.Split * Inner;
+  const int64_t Run1 = BDims[L.SplitDim] * Inner;
+  auto CopyRuns = [&](Value* Begin, Value* End, const vector<Value*>& C) {
+    emitLoop(Begin, End, 1, [&](Value* R) {
+      Value *Dst = Builder.CreateGEP(Elem, C[0], Builder.CreateMul(R, indexConst(Run0 + Run1)));
+      copyElements(Dst, Builder.CreateGEP(Elem, C[1], Builder.CreateMul(R, indexConst(Run0))),
+          indexConst(Run0));
+      copyElements(Builder.CreateGEP(Elem, Dst, indexConst(Run0)),
+          Builder.CreateGEP(Elem, C[2], Builder.CreateMul(R, indexConst(Run1))), indexConst(Run1));
+    }, "concatrun");
+  };
+  const vector<Value*> Buffers = {Out, V.Base[0], V.Base[1]};
+  if (Runs * (Run0 + Run1) < ParallelMinElements) {
+    CopyRuns(indexConst(0), indexConst(Runs), Buffers);
+  } else {
+    const int64_t Grain = std::max(ElementwiseGrain / (Run0 + Run1), (int64_t) 1);
+    emitParallelFor(Runs, Grain, Buffers, CopyRuns, "concat");
+  }
+  return true;
+}
 
-    Value *arg0 = Args[0]->codegen(F);
-    arg0 = Builder.CreateLoad(original_vec_type, arg0);
+// Returns the array V of shape Dims as a contiguous buffer of Elem, copying
+// it if it is a view (or of another element type). V's buffers are released
+// once copied.
+Value *materialize(const ArrayView& V, const vector<int>& Dims, Type* Elem) {
+  if (!V.Base[0]->getType()->isPointerTy() ||
+      (V.Layout.Segments == 0 && arrayElemTy(V.Base[0]) == Elem)) {
+    return V.Base[0];
+  }
+  int64_t Size = 1;
+  for (auto D : Dims) {
+    Size *= D;
+  }
+  Value *Out = takeBuffer(Size, Elem);
+  if (!emitConcatCopy(Out, V, Dims)) {
+    emitElementwiseViews(Out, Dims, {V}, {}, [](const vector<Value*>& X, const vector<Value*>& U) {
+      return X[0];
+    }, "copy");
+  }
+  releaseOperands({V}, Out);
+  CountStat("materialized_views", 1);
+  return Out;
+}
 
-    // for (int i=0;i<size;i++){
-    //   Value* element = Builder.CreateExtractElement(arg0, i);
-    //   element->print(llvm::outs());
-    // }
+// Evaluates an array expression without materializing views: expand and
+// concat (and variables bound to them) yield views, everything else a
+// contiguous buffer.
+ArrayView codegenArray(ASTNode* Expr, Function* F) {
+  if (Expr->GetType() == EXPR_TYPE_VARIABLE) {
+    auto B = Environment.find(static_cast<VariableASTNode*>(Expr)->Name);
+    if (B == Environment.end() || !B->second.Val) {
+      return contiguousView(Expr->codegen(F));
+    }
+    ArrayView V = {{B->second.Val, B->second.Val2}, B->second.Type.layout};
+    return V;
+  }
+  if (Expr->GetType() != EXPR_TYPE_FUNCALL) {
+    return contiguousView(Expr->codegen(F));
+  }
 
-    // auto dimension = type.dimensions.size();
-    // for (int i=0;i<dimension;i++){
-    //   cout << "dimension " << i << " " << type.dimensions[i] << endl;
-    // }
-    
-    // int new_size = size;
-    // auto *new_vec_type = VectorType::get(intTy(32), size);
-    auto alloc = Builder.CreateAlloca(vec_type);
+  auto *Call = static_cast<CallASTNode*>(Expr);
+  MiniAPLArrayType& type = TypeTable[Call];
+  if (Call->Callee == "expand") {
+    ArrayView In = codegenArray(Call->Args[0].get(), F);
+    ArrayView V = expandView(In, TypeTable[Call->Args[0].get()].dimensions);
+    type.layout = V.Layout;
+    return V;
+  } else if (Call->Callee == "concat") {
+    // Operands that are two segment views, or of another element type than
+    // the result, are copied first.
+    Type *Elem = elemTy(type.elem);
+    ArrayView Operands[2];
+    vector<int> Dims[2];
+    for (int i = 0; i < 2; i++) {
+      ASTNode *Arg = Call->Args[i].get();
+      Dims[i] = TypeTable[Arg].dimensions;
+      Operands[i] = codegenArray(Arg, F);
+      if (Operands[i].Layout.Segments == 2 || arrayElemTy(Operands[i].Base[0]) != Elem) {
+        Operands[i] = contiguousView(materialize(Operands[i], Dims[i], Elem));
+      }
+    }
+    ArrayView V = concatView(Operands[0], Dims[0], Operands[1], Dims[1], type.dim_to_concat);
+    type.layout = V.Layout;
+    return V;
+  }
+  return contiguousView(Expr->codegen(F));
+}
 
-    // cout << "size " << size << " innermost " << innermost << endl;
+// ---------------------------------------------------------------------------
+// Code generation functions that you should fill in for this assignment
+// ---------------------------------------------------------------------------
+Value *ProgramAST::codegen(Function* F) {
+  // STUDENTS: FILL IN THIS FUNCTION
+  for(auto& Stmt : Stmts) {
+    auto L = Liveness.find(Stmt.get());
+    CurrentLiveness = L != Liveness.end() ? &L->second : nullptr;
+    // The buffers of the variables that die here, as bound before the
+    // statement assigns anything. A view holds on to the buffers it reads.
+    vector<Value*> Dying;
+    if (CurrentLiveness) {
+      for (auto& Name : CurrentLiveness->Dying) {
+        Dying.push_back(Environment[Name].Val);
+        if (Environment[Name].Val2) {
+          Dying.push_back(Environment[Name].Val2);
+        }
+      }
+    }
 
-    for (int i = 0; i < size; i++) {
-      Value *sum = intConst(32, 0);
-      for (int j = 0; j < innermost; j++) {
-        Value *element = Builder.CreateExtractElement(arg0, i * innermost + j);
-        // element->print(llvm::outs());
-        sum = Builder.CreateAdd(sum, element);
-        
+    Value *V = Stmt->codegen(F);
+    if (Stmt->IsAssign() && CurrentLiveness) {
+      Binding& B = Environment[static_cast<AssignStmtAST*>(Stmt.get())->GetName()];
+      for (auto *Buffer : {B.Val, B.Val2}) {
+        if (Buffer && !CurrentLiveness->DeadStore) {
+          BufferRefs[Buffer]++;
+        } else {
+          releaseBuffer(Buffer);
+        }
       }
-      auto dst = Builder.CreateGEP(alloc, {intConst(32, 0), intConst(32, i)});
-      Builder.CreateStore(sum, dst);
+    } else if (CurrentLiveness) {
+      releaseBuffer(V);
     }
+    for (auto *D : Dying) {
+      BufferRefs[D]--;
+      releaseBuffer(D);
+    }
+  }
+  CurrentLiveness = nullptr;
+  return nullptr;
+}
+
+Value *AssignStmtAST::codegen(Function* F) {
+  // STUDENTS: FILL IN THIS FUNCTION
+  // Variables can be bound to views, so assigning expand or concat copies
+  // nothing.
+  ArrayView V = codegenArray(RHS.get(), F);
+  if (!V.Base[0])
+    return nullptr;
+  Binding& B = Environment[GetName()];
+  B.Val = V.Base[0];
+  B.Val2 = V.Base[1];
+  B.Type.layout = V.Layout;
+  return V.Base[0];
+}
 
-    // Value *sub = Builder.CreateSub(arg0, arg1);
+void codegen_print_array(const MiniAPLArrayType& type, Value* array_data);
 
-    // auto alloc = Builder.CreateAlloca(vec_type);
-    // auto dst = Builder.CreateGEP(alloc, {intConst(32, 0), intConst(32, 0)});
-    // Builder.CreateStore(sub, dst);
+Value *ExprStmtAST::codegen(Function* F) {
+  // STUDENTS: FILL IN THIS FUNCTION
+  // Evaluations print their result. Builtins that produce no array (print)
+  // return nullptr and have already written their output.
+  Value *V = Val->codegen(F);
+  if (!V || !V->getType()->isPointerTy())
+    return V;
 
-    // codegen_print_array(type.dimensions, sub, m, bb, 0, 0);
-    Value* arg_print = Builder.CreateLoad(vec_type, alloc);
-    codegen_print_array(type.dimensions, arg_print, m, bb, 0, 0);
-    kprintf_str(m, bb, "\n");
+  codegen_print_array(TypeTable[Val.get()], V);
+  return V;
+}
 
-    return alloc;
-  } else if (Callee == "expand") {
-    MiniAPLArrayType type = TypeTable[this];
-    const int size = type.Cardinality();
-    auto *vec_type = VectorType::get(intTy(32), size);
-    auto *original_vec_type = VectorType::get(intTy(32), size / type.innermost_dimension);
+Value *NumberASTNode::codegen(Function* F) {
+  // STUDENTS: FILL IN THIS FUNCTION
+  return ConstantInt::get(TheContext, APInt(32, Val));
+}
 
-    // cout << "size " << size << " innermost " << type.innermost_dimension << endl;
-    // for (int i=0;i<type.dimensions.size();i++){
-    //   cout << "dimension " << i << " " << type.dimensions[i] << endl;
-    // }
-    // dimension 0 3
-    // dimension 1 1
+Value *StringASTNode::codegen(Function* F) {
+  return Builder.CreateGlobalStringPtr(Val);
+}
 
-    Value *arg0 = Args[0]->codegen(F);
+Value *VariableASTNode::codegen(Function* F) {
+  // STUDENTS: FILL IN THIS FUNCTION
+  auto B = Environment.find(Name);
+  if (B == Environment.end() || !B->second.Val)
+    return LogErrorV("Unknown variable name");
+  // Builtins that read views use codegenArray; everyone else gets a buffer.
+  MiniAPLArrayType& type = TypeTable[this];
+  return materialize(codegenArray(this, F), type.dimensions, elemTy(type.elem));
+}
 
-    arg0 = Builder.CreateLoad(original_vec_type, arg0);
+// Literal values converted to T, as constant data.
+template<typename T>
+Constant *convertedElements(const vector<int32_t>& Vals) {
+  vector<T> Elems(Vals.begin(), Vals.end());
+  return ConstantDataArray::get(TheContext, Elems);
+}
+
+// The values of a literal as constant data of element type Elem.
+Constant *constantElements(const vector<int32_t>& Vals, const ElemType Elem) {
+  switch (Elem) {
+    case ELEM_I8: return convertedElements<uint8_t>(Vals);
+    case ELEM_I16: return convertedElements<uint16_t>(Vals);
+    case ELEM_I64: return convertedElements<uint64_t>(Vals);
+    case ELEM_F32: return convertedElements<float>(Vals);
+    case ELEM_F64: return convertedElements<double>(Vals);
+    default:
+      return ConstantDataArray::get(TheContext,
+          ArrayRef<uint32_t>(reinterpret_cast<const uint32_t*>(Vals.data()), Vals.size()));
+  }
+}
 
-    int nth_dim = type.innermost_dimension;
-    int n_plus_1 = type.dimensions[type.dimensions.size() - 1];
+Value *ArrayConstASTNode::codegen(Function* F) {
+  // Read-only data; nothing writes into an array once it is computed.
+  Constant *Init = constantElements(*Vals, Elem);
+  auto *Data = new GlobalVariable(*TheModule, Init->getType(), true,
+      GlobalValue::PrivateLinkage, Init, "const");
+  return Builder.CreateBitCast(Data, arrayPtrTy(Elem));
+}
 
-    int prev_dims = 1;
-    for (int i = 0; i < type.dimensions.size() - 2; i++) {
-      prev_dims *= type.dimensions[i];
+Value *FusedASTNode::codegen(Function* F) {
+  // Evaluate the leaves, which may be views. Leaves that name the same array
+  // are read once.
+  map<ASTNode*, int> LeafInput;
+  vector<ArrayView> Inputs;
+  for (auto *L : Leaves) {
+    ArrayView V = codegenArray(L, F);
+    int i = 0;
+    while (i < (int) Inputs.size() && !sameView(Inputs[i], V)) {
+      i++;
+    }
+    LeafInput[L] = i;
+    if (i == (int) Inputs.size()) {
+      Inputs.push_back(V);
     }
+  }
 
-    auto alloc = Builder.CreateAlloca(vec_type);
-    // prev dim
-    // n_plus_1
-    for (int i = 0; i < nth_dim * n_plus_1; i++) {
-      int k = i / nth_dim;
-      for (int j = 0; j < prev_dims; j++) {
-        Value *element = Builder.CreateExtractElement(arg0, j * n_plus_1 + k);
-        for (int q = 0; q < nth_dim; q++) {
-          auto dst = Builder.CreateGEP(alloc, {intConst(32, 0), intConst(32, j * n_plus_1 * nth_dim + n_plus_1*q + k)});
-          Builder.CreateStore(element, dst);
-        }
+  // Exponents are loop invariant, evaluate them up front. They are passed to
+  // the loop as uniform operands.
+  map<ASTNode*, int> PowerIndex;
+  vector<Value*> Powers;
+  std::function<void(ASTNode*)> EvalPowers = [&](ASTNode* N) {
+    if (LeafInput.count(N)) {
+      return;
+    }
+    auto *Call = static_cast<CallASTNode*>(N);
+    for (int i = 0; i < ElementwiseArrayArgs(Call); i++) {
+      EvalPowers(Call->Args[i].get());
+    }
+    if (Call->Callee == "exp") {
+      PowerIndex[N] = Powers.size();
+      Powers.push_back(codegenPower(Call->Args[1].get(), F));
+    }
+  };
+  EvalPowers(Root.get());
+
+  std::function<Value*(ASTNode*, const vector<Value*>&, const vector<Value*>&)> Eval =
+    [&](ASTNode* N, const vector<Value*>& X, const vector<Value*>& U) {
+      auto Leaf = LeafInput.find(N);
+      if (Leaf != LeafInput.end()) {
+        return X[Leaf->second];
+      }
+      auto *Call = static_cast<CallASTNode*>(N);
+      vector<Value*> Operands;
+      for (int i = 0; i < ElementwiseArrayArgs(Call); i++) {
+        Operands.push_back(Eval(Call->Args[i].get(), X, U));
       }
+      auto Power = PowerIndex.find(N);
+      return emitElementwiseOp(Call->Callee, Operands,
+          Power != PowerIndex.end() ? U[Power->second] : nullptr, elemTy(TypeTable[N].elem));
+    };
+
+  // Names the computation for the kernel library: the builtins in prefix
+  // order with the type they compute in, and the leaves by input.
+  std::function<string(ASTNode*)> Signature = [&](ASTNode* N) {
+    auto Leaf = LeafInput.find(N);
+    if (Leaf != LeafInput.end()) {
+      return "x" + str(Leaf->second);
     }
-    // for (int i = 0; i < nth_dim; i++) {
-    //   for (int j = 0; j < prev_dims; j++) {
-    //     Value *element = Builder.CreateExtractElement(arg0, j * nth_dim + i);
-    //     for (int k = 0; k < n_plus_1; k++) {
-    //       auto dst = Builder.CreateGEP(alloc, {intConst(32, 0), intConst(32, j * n_plus_1 + n_plus_1*k + i)});
-    //       Builder.CreateStore(element, dst);
-    //     }
-    //   }
-    // }
-    // for (int i = 0; i < n_plus_1; i++) {
-    //   for (int j = 0; j < prev_dims; j++) {
-    //     Value *element = Builder.CreateExtractElement(arg0, j * n_plus_1 + i);
-    //     for (int k = 0; k < nth_dim; k++) {
-    //       auto dst = Builder.CreateGEP(alloc, {intConst(32, 0), intConst(32, j * n_plus_1 + n_plus_1*k + i)});
-    //       Builder.CreateStore(element, dst);
-    //     }
-    //   }
-    // }
-
-    Value* arg_print = Builder.CreateLoad(vec_type, alloc);
-    codegen_print_array(type.dimensions, arg_print, m, bb, 0, 0);
-    kprintf_str(m, bb, "\n");
-    return alloc;
-
-    // // // kprintf_str(m, bb, "[");
-    // // // kprintf_val(m, bb, arg0);
-    // // // kprintf_str(m, bb, "]");
-    // for (unsigned i = 0; i < size; ++i) {
-    //   cout << "i " << i << endl;
-    //   // Value* element_ptr = Builder.CreateGEP(arg0, {intConst(32, 0), intConst(32, i)});
-    //   // Value* element_i = Builder.CreateLoad(element_ptr);
-    //   Value* element_i = Builder.CreateExtractElement(arg0, i);
-    //   // Value* arg_i = Args[i] -> codegen(F);
-    //   kprintf_str(m, bb, "[");
-    //   kprintf_val(m, bb, element_i);
-    //   kprintf_str(m, bb, "]");
-    // }
-
-    // Value* neg_ones = Builder.CreateVectorSplat(size, intConst(32, -1));
-    // Value* neg_arg0 = Builder.CreateMul(arg0, neg_ones);
-    // auto alloc = Builder.CreateAlloca(vec_type);
-    // auto dst = Builder.CreateGEP(alloc, {intConst(32, 0), intConst(32, 0)});
-    // Builder.CreateStore(neg_arg0, dst);
-  } else if (Callee == "concat") {
-    MiniAPLArrayType type = TypeTable[this];
-    const int size = type.Cardinality();
-    auto *vec_type = VectorType::get(intTy(32), size);
-    auto *original_vec_type_1 = VectorType::get(intTy(32), size * type.concat_dim1/ (type.concat_dim1 + type.concat_dim2));
-    auto *original_vec_type_2 = VectorType::get(intTy(32), size * type.concat_dim2/ (type.concat_dim1 + type.concat_dim2));
+    auto *Call = static_cast<CallASTNode*>(N);
+    string S = Call->Callee + "_" + ElemTypeNames[TypeTable[N].elem];
+    for (int i = 0; i < ElementwiseArrayArgs(Call); i++) {
+      S += "_" + Signature(Call->Args[i].get());
+    }
+    return S;
+  };
+
+  // The result may overwrite a dying leaf.
+  MiniAPLArrayType type = TypeTable[this];
+  vector<ASTNode*> InputLeaves(Inputs.size());
+  for (auto *L : Leaves) {
+    if (!InputLeaves[LeafInput[L]]) {
+      InputLeaves[LeafInput[L]] = L;
+    }
+  }
+  Value *Out = elementwiseOutput(type.Cardinality(), elemTy(type.elem), InputLeaves, Inputs);
+  emitElementwiseViews(Out, type.dimensions, Inputs, Powers,
+      [&](const vector<Value*>& X, const vector<Value*>& U) {
+        return Eval(Root.get(), X, U);
+      }, Signature(Root.get()));
+  releaseOperands(Inputs, Out);
+  return Out;
+}
 
-    Value *arg0 = Args[0]->codegen(F);
-    Value *arg1 = Args[1]->codegen(F);
-    int dim_to_concat = type.dim_to_concat;
+// Returns an i64* to a constant array holding `dims`, the form in which the
+// runtime takes array shapes.
+Value *shapeConstant(const vector<int>& dims) {
+  vector<uint64_t> Dims(dims.begin(), dims.end());
+  Constant *Init = ConstantDataArray::get(TheContext, Dims);
+  auto *Shape = new GlobalVariable(*TheModule, Init->getType(), true,
+      GlobalValue::PrivateLinkage, Init, "shape");
+  return Builder.CreateBitCast(Shape, PointerType::get(Type::getInt64Ty(TheContext), 0));
+}
 
-    arg0 = Builder.CreateLoad(original_vec_type_1, arg0);
-    arg1 = Builder.CreateLoad(original_vec_type_2, arg1);
-    // arg2 = Builder.CreateLoad(vec_type, arg2);
+// Prints an array by passing its buffer and shape to the runtime printer.
+void codegen_print_array(const MiniAPLArrayType& type, Value* array_data) {
+  Type *I64PtrTy = PointerType::get(Type::getInt64Ty(TheContext), 0);
+  const vector<int>& dims = type.dimensions;
+  if (type.elem == ELEM_I32) {
+    Function *Print = runtimeFunction("miniapl_print_array", Type::getVoidTy(TheContext),
+        {arrayPtrTy(), I64PtrTy, intTy(32)});
+    Builder.CreateCall(Print, {array_data, shapeConstant(dims), intConst(32, dims.size())});
+    return;
+  }
+  Type *I8PtrTy = Type::getInt8PtrTy(TheContext);
+  Function *Print = runtimeFunction("miniapl_print_typed_array", Type::getVoidTy(TheContext),
+      {I8PtrTy, intTy(32), I64PtrTy, intTy(32)});
+  Builder.CreateCall(Print, {Builder.CreateBitCast(array_data, I8PtrTy), intConst(32, type.elem),
+      shapeConstant(dims), intConst(32, dims.size())});
+}
+
+Value *CallASTNode::codegen(Function* F) {
+  Module *m = TheModule.get();
+  
+  if (IsElementwiseCall(this)) {
+    // Get the type of the result (and operands).
+    MiniAPLArrayType type = TypeTable[this];
 
-    int prev_dims = 1;
-    for (int i = 0; i < dim_to_concat; i++) {
-      prev_dims *= type.dimensions[i];
+    // Codegen arguments.
+    vector<ASTNode*> OperandArgs;
+    vector<ArrayView> Operands;
+    for (int i = 0; i < ElementwiseArrayArgs(this); i++) {
+      OperandArgs.push_back(Args[i].get());
+      Operands.push_back(codegenArray(Args[i].get(), F));
     }
-    int next_dims = 1;
-    for (int i = dim_to_concat + 1; i < type.dimensions.size(); i++) {
-      next_dims *= type.dimensions[i];
+    vector<Value*> Uniforms;
+    if (Callee == "exp") {
+      Uniforms.push_back(codegenPower(Args[1].get(), F));
     }
 
-    auto alloc = Builder.CreateAlloca(vec_type);
+    // Loop over the flat buffers, VectorBytes at a time, writing over a
+    // dying operand if there is one.
+    Type *Elem = elemTy(type.elem);
+    Value *Out = elementwiseOutput(type.Cardinality(), Elem, OperandArgs, Operands);
+    emitElementwiseViews(Out, type.dimensions, Operands, Uniforms,
+        [&](const vector<Value*>& X, const vector<Value*>& U) {
+          return emitElementwiseOp(Callee, X, U.empty() ? nullptr : U[0], Elem);
+        }, Callee);
+    releaseOperands(Operands, Out);
+    return Out;
+  } else if (Callee == "print") {
+    MiniAPLArrayType type = TypeTable[this];
 
-    for (int i = 0; i < type.concat_dim1; i++) {
-      for (int j = 0; j < prev_dims; j++) {
-        for (int k = 0; k < next_dims; k++) {
-          Value *element = Builder.CreateExtractElement(arg0, j * type.concat_dim1 * next_dims + i * next_dims + k);
-          auto dst = Builder.CreateGEP(alloc, {intConst(32, 0), intConst(32, j * (type.concat_dim1 + type.concat_dim2) * next_dims + i * next_dims + k)});
-          Builder.CreateStore(element, dst);
-        }
-      }
-    }
+    Value *arg0 = Args[0]->codegen(F);
 
-    for (int i = 0; i < type.concat_dim2; i++) {
-      for (int j = 0; j < prev_dims; j++) {
-        for (int k = 0; k < next_dims; k++) {
-          Value *element = Builder.CreateExtractElement(arg1, j * type.concat_dim2 * next_dims + i * next_dims + k);
-          auto dst = Builder.CreateGEP(alloc, {intConst(32, 0), intConst(32, j * (type.concat_dim1 + type.concat_dim2) * next_dims + type.concat_dim1 * next_dims + i * next_dims + k)});
-          Builder.CreateStore(element, dst);
-        }
-      }
-    }
+    codegen_print_array(type, arg0);
+    releaseBuffer(arg0);
 
+    return nullptr;
+  } else if (Callee == "load") {
+    // Maps the file; the array is used in place.
+    MiniAPLArrayType type = TypeTable[this];
+    Type *I8PtrTy = Type::getInt8PtrTy(TheContext);
+    Type *I64PtrTy = PointerType::get(Type::getInt64Ty(TheContext), 0);
+    Function *Load = runtimeFunction("miniapl_load_array", I8PtrTy,
+        {I8PtrTy, intTy(32), I64PtrTy, intTy(32)});
+    Value *Data = Builder.CreateCall(Load, {Args[0]->codegen(F), intConst(32, type.elem),
+        shapeConstant(type.dimensions), intConst(32, type.dimension())});
+    return Builder.CreateBitCast(Data, arrayPtrTy(type.elem));
+  } else if (Callee == "store") {
+    MiniAPLArrayType type = TypeTable[this];
+    Value *arg0 = Args[0]->codegen(F);
+    if (!arg0->getType()->isPointerTy()) {
+      Value *Boxed = allocArray(1, arg0->getType());
+      Builder.CreateStore(arg0, Boxed);
+      arg0 = Boxed;
+    }
+    Type *I8PtrTy = Type::getInt8PtrTy(TheContext);
+    Type *I64PtrTy = PointerType::get(Type::getInt64Ty(TheContext), 0);
+    Function *Store = runtimeFunction("miniapl_store_array", Type::getVoidTy(TheContext),
+        {I8PtrTy, I8PtrTy, intTy(32), I64PtrTy, intTy(32)});
+    Builder.CreateCall(Store, {Args[1]->codegen(F), Builder.CreateBitCast(arg0, I8PtrTy),
+        intConst(32, type.elem), shapeConstant(type.dimensions), intConst(32, type.dimension())});
+    releaseBuffer(arg0);
+    return nullptr;
+  } else if (Callee == "reduce") {
+    // reduce(<array>)` - Turn an N dimensional array into an N-1 dimensional array by adding up all numbers in the innermost dimension
 
+    MiniAPLArrayType type = TypeTable[this];
+    const int64_t size = type.Cardinality();
+    auto innermost = type.innermost_dimension;
 
-    Value* arg_print = Builder.CreateLoad(vec_type, alloc);
-    codegen_print_array(type.dimensions, arg_print, m, bb, 0, 0);
-    kprintf_str(m, bb, "\n");
-    return alloc;
+    // Views are summed in place rather than copied first.
+    ArrayView In = codegenArray(Args[0].get(), F);
+    const vector<int>& Dims = TypeTable[Args[0].get()].dimensions;
+    Value *Sums;
+    if (In.Layout.Segments != 0) {
+      Sums = emitViewRowSums(In, Dims);
+    } else if (useKernel(size * innermost) && innermost < 2 * ReduceBlockElements) {
+      Sums = emitRowSumsKernel(In.Base[0], Dims);
+    } else {
+      Sums = emitRowSums(In.Base[0], size, innermost);
+    }
+    releaseOperands({In}, Sums);
+    return Sums;
+  } else if (Callee == "expand" || Callee == "concat") {
+    // Only reached where a contiguous array is needed; everywhere else the
+    // result is used as a view.
+    MiniAPLArrayType type = TypeTable[this];
+    return materialize(codegenArray(this, F), type.dimensions, elemTy(type.elem));
   } else {
     return nullptr;
   }
@@ -1009,97 +2204,383 @@ Value *CallASTNode::codegen(Function* F) {
 }
 
 // ---------------------------------------------------------------------------
-// Parser utilities 
+// Lexer
+//
+// Tokens are StringRefs into the source buffer, which MemoryBuffer maps into
+// memory for large files, so scanning copies nothing. Integer literals are
+// converted as they are scanned.
 // ---------------------------------------------------------------------------
-class ParseState {
+enum TokenKind {
+  TOK_EOF,
+  TOK_IDENT,
+  TOK_INT,
+  TOK_PUNCT,  // one of , ( ) ; =
+  TOK_STRING, // a double quoted string; Text excludes the quotes
+  TOK_ERROR   // an integer literal that does not fit in 32 bits, or an
+              // unterminated string
+};
+
+struct Token {
+  TokenKind Kind;
+  StringRef Text;
+  int32_t IntVal;
+};
+
+static inline bool IsPunct(const char C) {
+  return C == ',' || C == '(' || C == ')' || C == ';' || C == '=';
+}
+
+static inline bool IsSpace(const char C) {
+  return C == ' ' || C == '\n' || C == '\t' || C == '\r' || C == '\f' || C == '\v';
+}
+
+class Lexer {
   public:
-    int Position;
-    vector<string> Tokens;
+    Lexer(StringRef Source) : Cur(Source.begin()), End(Source.end()) {}
 
-    ParseState(vector<string>& Tokens_) : Position(0), Tokens(Tokens_) {}
+    Token next() {
+      while (Cur != End && IsSpace(*Cur)) {
+        ++Cur;
+      }
+      if (Cur == End) {
+        return {TOK_EOF, StringRef(), 0};
+      }
+      const char *Start = Cur;
+      if (IsPunct(*Cur)) {
+        ++Cur;
+        return {TOK_PUNCT, StringRef(Start, 1), 0};
+      }
+      if (*Cur == '"') {
+        const char *Close = std::find(Cur + 1, End, '"');
+        if (Close == End) {
+          Cur = End;
+          return {TOK_ERROR, StringRef(Start, End - Start), 0};
+        }
+        Cur = Close + 1;
+        return {TOK_STRING, StringRef(Start + 1, Close - Start - 1), 0};
+      }
 
-    bool AtEnd() {
-      return Position == (int) Tokens.size();
+      // Anything else runs to the next space or punctuation. It is an
+      // integer if it is an optionally signed run of digits.
+      const char *Digits = Cur;
+      if (*Digits == '-' || *Digits == '+') {
+        ++Digits;
+      }
+      int64_t Magnitude = 0;
+      bool InRange = true;
+      for (Cur = Digits; Cur != End && *Cur >= '0' && *Cur <= '9'; ++Cur) {
+        Magnitude = Magnitude * 10 + (*Cur - '0');
+        InRange &= Magnitude <= (int64_t) INT32_MAX + 1;
+        Magnitude = std::min(Magnitude, (int64_t) INT32_MAX + 1);
+      }
+      bool IsInt = Cur != Digits && (Cur == End || IsSpace(*Cur) || IsPunct(*Cur));
+      while (Cur != End && !IsSpace(*Cur) && !IsPunct(*Cur)) {
+        ++Cur;
+      }
+      StringRef Text(Start, Cur - Start);
+      if (!IsInt) {
+        return {TOK_IDENT, Text, 0};
+      }
+      int64_t V = *Start == '-' ? -Magnitude : Magnitude;
+      if (!InRange || V > INT32_MAX) {
+        return {TOK_ERROR, Text, 0};
+      }
+      return {TOK_INT, Text, (int32_t) V};
     }
 
+  private:
+    const char *Cur;
+    const char *End;
+};
 
-    string peek() {
-      if (AtEnd()) {
-        return "";
-      }
-      return Tokens.at(Position);
+// ---------------------------------------------------------------------------
+// Parser utilities 
+// ---------------------------------------------------------------------------
+class ParseState {
+  public:
+    ParseState(StringRef Source) : Lex(Source) {
+      Current = Lex.next();
     }
 
-    string peek(const int Offset) {
-      assert(Position + Offset < Tokens.size());
-      return Tokens.at(Position + Offset);
+    bool AtEnd() const {
+      return Current.Kind == TOK_EOF;
     }
 
-    string eat() {
-      auto Current = peek();
-      Position++;
+    const Token& peek() const {
       return Current;
     }
+
+    bool peekPunct(const char C) const {
+      return Current.Kind == TOK_PUNCT && Current.Text[0] == C;
+    }
+
+    Token eat() {
+      Token T = Current;
+      Current = Lex.next();
+      return T;
+    }
+
+  private:
+    Lexer Lex;
+    Token Current;
 };
 
-std::ostream& operator<<(std::ostream& out, ParseState& PS) {
-  int i = 0;
-  for (auto T : PS.Tokens) {
-    if (i == PS.Position) {
-      out << " | ";
+// The error to report for a TOK_ERROR token.
+static const char *TokenError(const Token& T) {
+  return T.Text.startswith("\"") ? "unterminated string literal" : "integer literal out of range";
+}
+
+#define EAT(PS, c) if (!PS.peekPunct(c)) { return LogError("expected " #c); } PS.eat();
+
+// The arguments of mkArray([type,] rank, dims..., values...) after the
+// opening parenthesis. Apart from the element type (i32 by default) they
+// must be integer literals; the values are read straight into the array's
+// buffer, so literals of any size cost one pass over the source. Missing
+// trailing values are zero.
+static unique_ptr<ASTNode> ParseArrayLiteral(ParseState& PS) {
+  ElemType Elem = ELEM_I32;
+  if (PS.peek().Kind == TOK_IDENT && ParseElemType(PS.peek().Text, Elem)) {
+    PS.eat();
+    EAT(PS, ',');
+  }
+  int Rank = -1;
+  vector<int> Dims;
+  auto *Vals = new vector<int32_t>();
+  ArrayData Data(Vals);
+  int64_t Size = 1;
+  while (!PS.peekPunct(')')) {
+    if (Rank >= 0) {
+      EAT(PS, ',');
+    }
+    Token T = PS.eat();
+    if (T.Kind == TOK_ERROR) {
+      return LogError(TokenError(T));
+    } else if (T.Kind != TOK_INT) {
+      return LogError("mkArray arguments must be integer literals");
+    }
+    if (Rank < 0) {
+      Rank = T.IntVal;
+      if (Rank < 0) {
+        return LogError("mkArray rank must not be negative");
+      }
+    } else if ((int) Dims.size() < Rank) {
+      if (T.IntVal <= 0) {
+        return LogError("mkArray dimensions must be positive");
+      }
+      Dims.push_back(T.IntVal);
+      Size *= T.IntVal;
+      if (Size > INT32_MAX) {
+        return LogError("mkArray has too many elements");
+      }
+      if ((int) Dims.size() == Rank) {
+        Vals->reserve(Size);
+      }
+    } else if ((int64_t) Vals->size() < Size) {
+      Vals->push_back(T.IntVal);
+    } else {
+      return LogError("mkArray has more values than elements");
     }
-    out << T << " ";
-    i++;
   }
-  return out;
+  PS.eat(); // consume ")"
+  if (Rank < 0 || (int) Dims.size() < Rank) {
+    return LogError("mkArray is missing dimensions");
+  }
+  Vals->resize(Size, 0);
+  return unique_ptr<ASTNode>(new ArrayConstASTNode(Dims, Data, Elem));
 }
 
-#define EAT(PS, t) if (PS.eat() != (t)) { return LogError("EAT ERROR"); }
-
 unique_ptr<ASTNode> ParseExpr(ParseState& PS) {
-  string Name = PS.eat();
-  if (is_int(Name)) {
-    return unique_ptr<ASTNode>(new NumberASTNode(stoi(Name)));
+  Token T = PS.eat();
+  if (T.Kind == TOK_INT) {
+    return unique_ptr<ASTNode>(new NumberASTNode(T.IntVal));
+  }
+  if (T.Kind == TOK_STRING) {
+    return unique_ptr<ASTNode>(new StringASTNode(T.Text.str()));
+  }
+  if (T.Kind == TOK_ERROR) {
+    return LogError(TokenError(T));
+  }
+  if (T.Kind != TOK_IDENT) {
+    return LogError("expected an expression");
   }
 
-  if (PS.peek() == "(") {
+  if (PS.peekPunct('(')) {
     // Parse a function call
 
     PS.eat(); // consume "("
 
+    if (T.Text == "mkArray") {
+      return ParseArrayLiteral(PS);
+    }
+
     vector<unique_ptr<ASTNode> > Args;
-    while (PS.peek() != ")") {
-      Args.push_back(ParseExpr(PS));
-      if (PS.peek() != ")") {
-        EAT(PS, ",");
+    while (!PS.peekPunct(')')) {
+      auto Arg = ParseExpr(PS);
+      if (!Arg) {
+        return nullptr;
+      }
+      Args.push_back(move(Arg));
+      if (!PS.peekPunct(')')) {
+        EAT(PS, ',');
       }
     }
-    EAT(PS, ")");
+    EAT(PS, ')');
 
-    return unique_ptr<ASTNode>(new CallASTNode(Name, move(Args)));
-  } else {
-    return unique_ptr<ASTNode>(new VariableASTNode(Name));
+    return unique_ptr<ASTNode>(new CallASTNode(T.Text.str(), move(Args)));
+  }
+
+  // Element type names are reserved.
+  ElemType Elem;
+  if (ParseElemType(T.Text, Elem)) {
+    return unique_ptr<ASTNode>(new ElemTypeASTNode(Elem));
+  }
+  return unique_ptr<ASTNode>(new VariableASTNode(T.Text.str()));
+}
+
+// Parses `assign <name> = <expr>` or `<expr>`, without the closing ";".
+unique_ptr<StmtAST> ParseStmt(ParseState& PS) {
+  if (PS.peek().Kind == TOK_IDENT && PS.peek().Text == "assign") {
+    PS.eat(); // eat "assign"
+
+    Token Var = PS.eat();
+    ElemType Elem;
+    if (Var.Kind != TOK_IDENT || ParseElemType(Var.Text, Elem)) {
+      LogError("expected a variable name after assign");
+      return nullptr;
+    }
+    if (!PS.peekPunct('=')) {
+      LogError("expected '=' after the variable name");
+      return nullptr;
+    }
+    PS.eat();
+
+    unique_ptr<ASTNode> value = ParseExpr(PS);
+    if (!value) {
+      return nullptr;
+    }
+    return unique_ptr<StmtAST>(new AssignStmtAST(Var.Text.str(), move(value)));
+  }
+
+  unique_ptr<ASTNode> value = ParseExpr(PS);
+  if (!value) {
+    return nullptr;
   }
+  return unique_ptr<StmtAST>(new ExprStmtAST(move(value)));
+}
+
+// Parses the whole source in a single pass. Returns false after reporting
+// the first syntax error.
+bool ParseProgram(StringRef Source, ProgramAST& Prog) {
+  ParseState PS(Source);
+  while (!PS.AtEnd()) {
+    if (PS.peekPunct(';')) {
+      PS.eat(); // empty statement
+      continue;
+    }
+    auto S = ParseStmt(PS);
+    if (!S) {
+      return false;
+    }
+    Prog.Stmts.push_back(move(S));
+    if (PS.peekPunct(';')) {
+      PS.eat();
+    } else if (!PS.AtEnd()) {
+      LogError("expected ';' after a statement");
+      return false;
+    }
+  }
+  return true;
 }
 
 // ---------------------------------------------------------------------------
 // Driver function for type-checking 
 // ---------------------------------------------------------------------------
-void SetType(map<ASTNode*, MiniAPLArrayType>& Types, ASTNode* Expr) {
+
+// Type of load("path"[, type][, rank, dims...]). The element type and the
+// shape default to the file's, which are read from its header and added to
+// the call, so that the program (and the object cache key derived from it)
+// spells them out and the runtime checks the file against them.
+MiniAPLArrayType LoadShape(CallASTNode* Call) {
+  auto& Args = Call->Args;
+  if (Args.empty() || Args[0]->GetType() != EXPR_TYPE_STRING) {
+    fprintf(stderr, "Error: load expects a path string literal\n");
+    exit(1);
+  }
+  const string& Path = static_cast<StringASTNode*>(Args[0].get())->Val;
+
+  // With a shape, the element type defaults to i32 and the file need not
+  // exist until the program runs. Only what is left out is read from it.
+  const bool HasElem = Args.size() > 1 && Args[1]->GetType() == EXPR_TYPE_ELEM_TYPE;
+  const bool HasShape = Args.size() > (HasElem ? 2u : 1u);
+  if (!HasElem && HasShape) {
+    Args.insert(Args.begin() + 1, unique_ptr<ASTNode>(new ElemTypeASTNode(ELEM_I32)));
+  } else if (!HasShape) {
+    int32_t FileElem;
+    int64_t Dims[MINIAPL_MAX_RANK];
+    int32_t Rank = miniapl_array_file_shape(Path.c_str(), &FileElem, Dims);
+    if (Rank < 0) {
+      fprintf(stderr, "Error: %s is not a MiniAPL array file\n", Path.c_str());
+      exit(1);
+    }
+    if (!HasElem) {
+      Args.insert(Args.begin() + 1, unique_ptr<ASTNode>(new ElemTypeASTNode((ElemType) FileElem)));
+    }
+    Args.push_back(unique_ptr<ASTNode>(new NumberASTNode(Rank)));
+    for (int32_t d = 0; d < Rank; d++) {
+      if (Dims[d] > INT32_MAX) {
+        fprintf(stderr, "Error: %s has a dimension longer than %d\n", Path.c_str(), INT32_MAX);
+        exit(1);
+      }
+      Args.push_back(unique_ptr<ASTNode>(new NumberASTNode(Dims[d])));
+    }
+  }
+
+  vector<int> Shape;
+  for (int i = 2; i < (int) Args.size(); i++) {
+    if (Args[i]->GetType() != EXPR_TYPE_SCALAR) {
+      fprintf(stderr, "Error: the shape of load must be integer literals\n");
+      exit(1);
+    }
+    int V = static_cast<NumberASTNode*>(Args[i].get())->Val;
+    if (i > 2) {
+      Shape.push_back(V);
+    } else if (V < 0 || V > MINIAPL_MAX_RANK || V != (int) Args.size() - 3) {
+      fprintf(stderr, "Error: load rank does not match its dimensions\n");
+      exit(1);
+    }
+  }
+  MiniAPLArrayType Result = {Shape};
+  Result.elem = static_cast<ElemTypeASTNode*>(Args[1].get())->Val;
+  return Result;
+}
+
+// Largest array, in bytes: more than a 64-bit process can address. Element
+// counts and byte sizes of arrays within it fit in int64_t with room to
+// spare, so codegen and the runtime can compute them without overflow.
+static const int64_t MaxArrayBytes = int64_t(1) << 48;
+
+// Exits with an error unless an array of type T fits in MaxArrayBytes.
+static void CheckArraySize(MiniAPLArrayType& T) {
+  int64_t Bytes = miniapl_elem_bytes(T.elem);
+  for (auto D : T.dimensions) {
+    if (D > 0 && Bytes > MaxArrayBytes / D) {
+      std::ostringstream Shape;
+      Shape << T;
+      fprintf(stderr, "Error: an array of shape %s is too large\n", Shape.str().c_str());
+      exit(1);
+    }
+    Bytes *= D;
+  }
+}
+
+void SetType(unordered_map<ASTNode*, MiniAPLArrayType>& Types, ASTNode* Expr) {
   if (Expr->GetType() == EXPR_TYPE_FUNCALL) {
     CallASTNode* Call = static_cast<CallASTNode*>(Expr);
     for (auto& A : Call->Args) {
       SetType(Types, A.get());
     }
 
-    if (Call->Callee == "mkArray") {
-      int NDims = static_cast<NumberASTNode*>(Call->Args.at(0).get())->Val;
-      vector<int> Dims;
-      for (int i = 0; i < NDims; i++) {
-        Dims.push_back(static_cast<NumberASTNode*>(Call->Args.at(i + 1).get())->Val);
-      }
-      Types[Expr] = {Dims};
-    } else if (Call->Callee == "reduce") {
+    if (Call->Callee == "reduce") {
       Types[Expr] = Types[Call->Args.back().get()];
       Types[Expr].innermost_dimension = Types[Expr].dimensions[Types[Expr].dimensions.size() - 1];
       Types[Expr].dimensions.pop_back();
@@ -1129,154 +2610,1241 @@ void SetType(map<ASTNode*, MiniAPLArrayType>& Types, ASTNode* Expr) {
       // }
       // cout << "concat_dim " << concat_dim << endl;
       auto final_dim = dim1;
+      if ((int64_t) dim1[concat_dim] + dim2[concat_dim] > INT32_MAX) {
+        fprintf(stderr, "Error: concat result has a dimension longer than %d\n", INT32_MAX);
+        exit(1);
+      }
       final_dim[concat_dim] += dim2[concat_dim];
       Types[Expr] = Types[Call->Args.at(0).get()];
       Types[Expr].dimensions = final_dim;
       Types[Expr].concat_dim1 = dim1[concat_dim];
       Types[Expr].concat_dim2 = dim2[concat_dim];
       Types[Expr].dim_to_concat = concat_dim;
+      Types[Expr].elem = PromoteElemTypes(Types[Call->Args.at(0).get()].elem,
+          Types[Call->Args.at(1).get()].elem);
+    } else if (Call->Callee == "load") {
+      Types[Expr] = LoadShape(Call);
     } else if (Call->Callee == "add" || Call->Callee == "sub") {
       Types[Expr] = Types[Call->Args.at(0).get()];
+      Types[Expr].elem = PromoteElemTypes(Types[Call->Args.at(0).get()].elem,
+          Types[Call->Args.at(1).get()].elem);
     } else {
       Types[Expr] = Types[Call->Args.at(0).get()];
     }
+    CheckArraySize(Types[Expr]);
+  } else if (Expr->GetType() == EXPR_TYPE_CONSTANT) {
+    auto *Const = static_cast<ArrayConstASTNode*>(Expr);
+    Types[Expr] = {Const->Dims};
+    Types[Expr].elem = Const->Elem;
+    CheckArraySize(Types[Expr]);
   } else if (Expr->GetType() == EXPR_TYPE_SCALAR) {
     Types[Expr] = {{1}};
   } else if (Expr->GetType() == EXPR_TYPE_VARIABLE) {
-    string ExprName = static_cast<VariableASTNode*>(Expr)->Name;
-    for (auto T : Types) {
-      auto V = T.first;
-      if (V->GetType() == EXPR_TYPE_VARIABLE) {
-        string Name = static_cast<VariableASTNode*>(V)->Name;
-        if (Name == ExprName) {
-          Types[Expr] = T.second;
-        }
-      }
+    auto B = Environment.find(static_cast<VariableASTNode*>(Expr)->Name);
+    if (B != Environment.end()) {
+      Types[Expr] = B->second.Type;
     }
   }
 
 }
 
-int main(const int argc, const char** argv) {
-  assert(argc == 2);
-
-  // Read in the source code file to a string
-  string target_file = argv[1];
-
-  std::ifstream t(target_file);
-  std::string str((std::istreambuf_iterator<char>(t)),
-      std::istreambuf_iterator<char>());
-
-  // Tokenize the file
-  vector<string> Tokens;
-  string NextToken = "";
-  for (int i = 0; i < (int) str.size(); i++) {
-    char NC = str[i];
-    if (NC == ',' || NC == '(' || NC == ')' || NC == ';' || NC == '=') {
-      if (NextToken != "") {
-        Tokens.push_back(NextToken);
-      }
-      NextToken = string("") + NC;
-      Tokens.push_back(NextToken);
-      NextToken = "";
-    } else if (!isspace(NC)) {
-      NextToken += NC;
-    } else {
-      assert(isspace(NC));
-      if (NextToken != "") {
-        Tokens.push_back(NextToken);
-      }
-      NextToken = "";
-    }
-  }
-  if (NextToken != "") {
-    Tokens.push_back(NextToken);
-  }
-
-  vector<vector<string> > Stmts;
-  vector<string> Toks;
-  for (auto t : Tokens) {
-    if (t == ";") {
-      Stmts.push_back(Toks);
-      Toks = {};
-    } else {
-      Toks.push_back(t);
-    }
+// Types a statement. Assignments bind the name to the type of their value
+// for the statements that follow.
+void TypeCheckStatement(StmtAST* SA) {
+  if (SA->IsAssign()) {
+    AssignStmtAST* Assign = static_cast<AssignStmtAST*>(SA);
+    SetType(TypeTable, Assign->RHS.get());
+    TypeTable[Assign->Name.get()] = TypeTable[Assign->RHS.get()];
+    Environment[Assign->GetName()] = {TypeTable[Assign->RHS.get()], nullptr};
+  } else {
+    ExprStmtAST* Expr = static_cast<ExprStmtAST*>(SA);
+    SetType(TypeTable, Expr->Val.get());
   }
+}
 
-  if (Toks.size() > 0) {
-    Stmts.push_back(Toks);
-  }
+// ---------------------------------------------------------------------------
+// Compile-time evaluation
+//
+// Builtins whose operands are all known are evaluated here with the same
+// wrap-around int32 arithmetic as the generated code. Arrays of other
+// element types are left to the generated code.
+// ---------------------------------------------------------------------------
+static int32_t WrapAdd(const int32_t a, const int32_t b) {
+  return (int32_t) ((uint32_t) a + (uint32_t) b);
+}
 
-  // Parse each statement
-  vector<unique_ptr<StmtAST> > ParsedStmts;
-  for (auto S : Stmts) {
-    ParseState PS(S);
-    assert(S.size() > 0);
-    if (PS.peek() != "assign") {
-      unique_ptr<ASTNode> value = ParseExpr(PS);
-      ParsedStmts.push_back(std::unique_ptr<StmtAST>(new ExprStmtAST(move(value))));
-    } else {
-      PS.eat(); // eat "assign"
+static int32_t WrapSub(const int32_t a, const int32_t b) {
+  return (int32_t) ((uint32_t) a - (uint32_t) b);
+}
 
-      string Var = PS.eat();
+static int32_t WrapMul(const int32_t a, const int32_t b) {
+  return (int32_t) ((uint32_t) a * (uint32_t) b);
+}
 
-      if (PS.eat() != "=") {
-      } else {
-        unique_ptr<ASTNode> value = ParseExpr(PS);
-        ParsedStmts.push_back(std::unique_ptr<StmtAST>(new AssignStmtAST(Var, move(value))));
-      }
+// Same binary exponentiation as emitPowerLoop.
+static int32_t IntPower(int32_t Base, int32_t Power) {
+  int32_t Result = 1;
+  while (Power > 0) {
+    if (Power & 1) {
+      Result = WrapMul(Result, Base);
     }
+    Base = WrapMul(Base, Base);
+    Power = (int32_t) ((uint32_t) Power >> 1);
   }
+  return Result;
+}
 
-  // Collect the statements into a program
-  ProgramAST prog;
-  prog.Stmts = move(ParsedStmts);
+// Computes builtin `Call` from the values of its arguments. Scalar arguments
+// are passed as one element arrays.
+static ArrayData EvaluateBuiltin(CallASTNode* Call, const vector<ArrayData>& ArgVals) {
+  MiniAPLArrayType type = TypeTable[Call];
+  const int64_t size = type.Cardinality();
+  auto *Out = new vector<int32_t>(size);
+  ArrayData Result(Out);
+  const string& Callee = Call->Callee;
+
+  if (Callee == "add" || Callee == "sub") {
+    const vector<int32_t>& A = *ArgVals[0];
+    const vector<int32_t>& B = *ArgVals[1];
+    for (int i = 0; i < size; i++) {
+      (*Out)[i] = Callee == "add" ? WrapAdd(A[i], B[i]) : WrapSub(A[i], B[i]);
+    }
+  } else if (Callee == "neg") {
+    const vector<int32_t>& A = *ArgVals[0];
+    for (int i = 0; i < size; i++) {
+      (*Out)[i] = WrapSub(0, A[i]);
+    }
+  } else if (Callee == "exp") {
+    const vector<int32_t>& A = *ArgVals[0];
+    const int32_t Power = (*ArgVals[1])[0];
+    for (int i = 0; i < size; i++) {
+      (*Out)[i] = IntPower(A[i], Power);
+    }
+  } else if (Callee == "reduce") {
+    const vector<int32_t>& A = *ArgVals[0];
+    const int cols = type.innermost_dimension;
+    for (int r = 0; r < size; r++) {
+      int32_t Sum = 0;
+      for (int j = 0; j < cols; j++) {
+        Sum = WrapAdd(Sum, A[r * cols + j]);
+      }
+      (*Out)[r] = Sum;
+    }
+  } else if (Callee == "expand") {
+    // [..., times, last]: every row of the operand is repeated `times` times.
+    const vector<int32_t>& A = *ArgVals[0];
+    const int last = type.dimensions.back();
+    const int times = type.innermost_dimension;
+    for (int i = 0; i < size; i++) {
+      const int row = i / last / times;
+      (*Out)[i] = A[row * last + i % last];
+    }
+  } else if (Callee == "concat") {
+    const vector<int32_t>& A = *ArgVals[0];
+    const vector<int32_t>& B = *ArgVals[1];
+    int next_dims = 1;
+    for (int i = type.dim_to_concat + 1; i < (int) type.dimensions.size(); i++) {
+      next_dims *= type.dimensions[i];
+    }
+    const int run1 = type.concat_dim1 * next_dims;
+    const int run2 = type.concat_dim2 * next_dims;
+    for (int i = 0; i < size; i++) {
+      const int j = i / (run1 + run2);
+      const int k = i % (run1 + run2);
+      (*Out)[i] = k < run1 ? A[j * run1 + k] : B[j * run2 + k - run1];
+    }
+  } else {
+    return nullptr;
+  }
+  return Result;
+}
 
-  // Infer types
-  for (auto& S : prog.Stmts) {
-    StmtAST* SA = S.get();
-    if (SA->IsAssign()) {
-      AssignStmtAST* Assign = static_cast<AssignStmtAST*>(SA);
-      SetType(TypeTable, Assign->RHS.get());
-      TypeTable[Assign->Name.get()] = TypeTable[Assign->RHS.get()];
+// Value of an expression that needs no evaluation: a literal, a folded array
+// or a variable bound to a known array. nullptr otherwise.
+static ArrayData KnownValue(ASTNode* Expr, unordered_map<string, ArrayData>& Env) {
+  if (Expr->GetType() == EXPR_TYPE_CONSTANT) {
+    auto *Const = static_cast<ArrayConstASTNode*>(Expr);
+    return Const->Elem == ELEM_I32 ? Const->Vals : nullptr;
+  } else if (Expr->GetType() == EXPR_TYPE_SCALAR) {
+    return ArrayData(new vector<int32_t>(1, static_cast<NumberASTNode*>(Expr)->Val));
+  } else if (Expr->GetType() == EXPR_TYPE_VARIABLE) {
+    return Env[static_cast<VariableASTNode*>(Expr)->Name];
+  }
+  return nullptr;
+}
+
+// Folds the constant parts of Expr: every builtin call whose operands are
+// known and whose result has at most FoldLimit elements is replaced by an
+// ArrayConstASTNode. Returns Expr's value, or nullptr if it is not known.
+static ArrayData FoldExpr(unique_ptr<ASTNode>& Expr, unordered_map<string, ArrayData>& Env) {
+  if (Expr->GetType() != EXPR_TYPE_FUNCALL) {
+    return KnownValue(Expr.get(), Env);
+  }
+  auto *Call = static_cast<CallASTNode*>(Expr.get());
+  MiniAPLArrayType type = TypeTable[Call];
+
+  vector<ArrayData> ArgVals;
+  bool Known = true;
+  for (auto& A : Call->Args) {
+    ArgVals.push_back(FoldExpr(A, Env));
+    Known &= ArgVals.back() != nullptr;
+  }
+  if (!Known || Call->Callee == "print" || type.elem != ELEM_I32 || type.Cardinality() > FoldLimit) {
+    return nullptr;
+  }
+  ArrayData Result = EvaluateBuiltin(Call, ArgVals);
+  if (!Result) {
+    return nullptr;
+  }
+
+  auto *Folded = new ArrayConstASTNode(type.dimensions, Result);
+  TypeTable[Folded] = type;
+  Expr.reset(Folded);
+  return Result;
+}
+
+// An array printed by the program, in order.
+struct FoldedOutput {
+  ArrayData Data;
+  vector<int> Dims;
+};
+
+// Folds constants throughout the program. Returns true if the value of every
+// statement is known, in which case Outputs holds everything the program
+// prints and no code needs to be generated at all.
+bool FoldConstants(ProgramAST& Prog, vector<FoldedOutput>& Outputs) {
+  if (FoldLimit <= 0) {
+    return false;
+  }
+  unordered_map<string, ArrayData> Env;
+  bool AllKnown = true;
+  for (auto& S : Prog.Stmts) {
+    if (S->IsAssign()) {
+      auto *Assign = static_cast<AssignStmtAST*>(S.get());
+      ArrayData V = FoldExpr(Assign->RHS, Env);
+      Env[Assign->GetName()] = V;
+      AllKnown &= V != nullptr;
+      continue;
+    }
+
+    unique_ptr<ASTNode>& Val = static_cast<ExprStmtAST*>(S.get())->Val;
+    ArrayData V = FoldExpr(Val, Env);
+    ASTNode *Printed = Val.get();
+    if (Val->GetType() == EXPR_TYPE_FUNCALL && static_cast<CallASTNode*>(Val.get())->Callee == "print") {
+      Printed = static_cast<CallASTNode*>(Val.get())->Args[0].get();
+      V = KnownValue(Printed, Env);
+    }
+    AllKnown &= V != nullptr;
+    if (V) {
+      Outputs.push_back({V, TypeTable[Printed].dimensions});
+    }
+  }
+  return AllKnown;
+}
+
+// ---------------------------------------------------------------------------
+// Interpreter
+//
+// Small programs run directly on the AST using the compile-time evaluator's
+// native loops, which avoids the cost of setting up LLVM and the JIT. Larger
+// programs are promoted to the JIT.
+// ---------------------------------------------------------------------------
+enum ExecutionTier {
+  TIER_AUTO,
+  TIER_INTERPRETER,
+  TIER_JIT
+};
+
+// Programs computing more array elements than this, or with more statements,
+// are compiled rather than interpreted.
+static const int64_t InterpreterMaxElements = int64_t(1) << 22;
+static const int InterpreterMaxStmts = 10000;
+
+void PrintArrayData(ArrayData Data, const vector<int>& dims) {
+  vector<int64_t> Dims(dims.begin(), dims.end());
+  miniapl_print_array(Data->data(), Dims.data(), Dims.size());
+}
+
+static ArrayData Interpret(ASTNode* Expr, unordered_map<string, ArrayData>& Env) {
+  if (Expr->GetType() != EXPR_TYPE_FUNCALL) {
+    return KnownValue(Expr, Env);
+  }
+  auto *Call = static_cast<CallASTNode*>(Expr);
+  vector<ArrayData> ArgVals;
+  for (auto& A : Call->Args) {
+    ArgVals.push_back(Interpret(A.get(), Env));
+  }
+  if (Call->Callee == "print") {
+    PrintArrayData(ArgVals[0], TypeTable[Call->Args[0].get()].dimensions);
+    return nullptr;
+  }
+  if (Call->Callee == "load" || Call->Callee == "store") {
+    MiniAPLArrayType type = TypeTable[Call];
+    vector<int64_t> Dims(type.dimensions.begin(), type.dimensions.end());
+    if (Call->Callee == "store") {
+      const string& Path = static_cast<StringASTNode*>(Call->Args[1].get())->Val;
+      miniapl_store_array(Path.c_str(), ArgVals[0]->data(), MINIAPL_I32, Dims.data(), Dims.size());
+      return nullptr;
+    }
+    // Interpreted programs are small, so a copy of the mapping is cheap.
+    const string& Path = static_cast<StringASTNode*>(Call->Args[0].get())->Val;
+    const int32_t *Data = static_cast<const int32_t*>(
+        miniapl_load_array(Path.c_str(), MINIAPL_I32, Dims.data(), Dims.size()));
+    return ArrayData(new vector<int32_t>(Data, Data + type.Cardinality()));
+  }
+  return EvaluateBuiltin(Call, ArgVals);
+}
+
+void InterpretProgram(ProgramAST& Prog) {
+  unordered_map<string, ArrayData> Env;
+  for (auto& S : Prog.Stmts) {
+    if (S->IsAssign()) {
+      auto *Assign = static_cast<AssignStmtAST*>(S.get());
+      Env[Assign->GetName()] = Interpret(Assign->RHS.get(), Env);
     } else {
-      ExprStmtAST* Expr = static_cast<ExprStmtAST*>(SA);
-      SetType(TypeTable, Expr->Val.get());
+      ASTNode *Val = static_cast<ExprStmtAST*>(S.get())->Val.get();
+      ArrayData V = Interpret(Val, Env);
+      if (V) {
+        PrintArrayData(V, TypeTable[Val].dimensions);
+      }
+    }
+  }
+}
+
+// Total number of elements the builtins of Expr compute.
+static int64_t ExprWork(ASTNode* Expr) {
+  if (Expr->GetType() != EXPR_TYPE_FUNCALL) {
+    return 0;
+  }
+  auto *Call = static_cast<CallASTNode*>(Expr);
+  int64_t Work = TypeTable[Call].Cardinality();
+  for (auto& A : Call->Args) {
+    Work += ExprWork(A.get());
+  }
+  return Work;
+}
+
+// True if every array Expr computes or reads is i32.
+static bool IsInt32Expr(ASTNode* Expr) {
+  auto T = TypeTable.find(Expr);
+  if (T != TypeTable.end() && T->second.elem != ELEM_I32) {
+    return false;
+  }
+  if (Expr->GetType() == EXPR_TYPE_FUNCALL) {
+    for (auto& A : static_cast<CallASTNode*>(Expr)->Args) {
+      if (!IsInt32Expr(A.get())) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// The interpreter computes in i32 only; programs using other element types
+// are always compiled.
+bool CanInterpret(ProgramAST& Prog) {
+  for (auto& S : Prog.Stmts) {
+    ASTNode *Expr = S->IsAssign() ? static_cast<AssignStmtAST*>(S.get())->RHS.get()
+                                  : static_cast<ExprStmtAST*>(S.get())->Val.get();
+    if (!IsInt32Expr(Expr)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Decides whether the program is small enough to interpret.
+bool PreferInterpreter(ProgramAST& Prog) {
+  if ((int) Prog.Stmts.size() > InterpreterMaxStmts) {
+    return false;
+  }
+  int64_t Work = 0;
+  for (auto& S : Prog.Stmts) {
+    if (S->IsAssign()) {
+      Work += ExprWork(static_cast<AssignStmtAST*>(S.get())->RHS.get());
+    } else {
+      Work += ExprWork(static_cast<ExprStmtAST*>(S.get())->Val.get());
+    }
+  }
+  return Work <= InterpreterMaxElements;
+}
+
+// ---------------------------------------------------------------------------
+// Common subexpression elimination
+//
+// Builtin calls that occur more than once with the same operands anywhere in
+// the program are computed once. The first occurrence is hoisted into an
+// assignment to a fresh variable just before its statement, and every
+// occurrence reads that variable, sharing its buffer. Expressions are
+// hash-consed: each distinct (builtin, operand ids) gets an id. A variable
+// is identified by its name and the number of assignments to it so far, so
+// reading a variable after it is reassigned is a different expression.
+// Expressions containing print, store or load are never shared, since they
+// have effects or observe them: a store between two reads of a file changes
+// what the second one loads.
+// ---------------------------------------------------------------------------
+struct CSEState {
+  // Id of each distinct expression, by key.
+  unordered_map<string, int> Ids;
+  // Id of every expression node in the program.
+  unordered_map<ASTNode*, int> NodeId;
+  // Occurrences of each id that are still computed.
+  vector<int> Count;
+  // Whether each id has effects or reads files.
+  vector<bool> Effects;
+  // Number of assignments to each variable seen so far.
+  unordered_map<string, int> Versions;
+  // Variable holding each hoisted expression, by id.
+  unordered_map<int, string> Hoisted;
+  // Assignments to insert before the current statement.
+  vector<unique_ptr<StmtAST>> Pending;
+};
+
+static bool IsShareable(ASTNode* Expr, CSEState& S) {
+  return Expr->GetType() == EXPR_TYPE_FUNCALL && !S.Effects[S.NodeId[Expr]];
+}
+
+// Returns the id of Expr, numbering its operands first.
+static int HashCons(ASTNode* Expr, CSEState& S) {
+  string Key;
+  bool Effects = false;
+  if (Expr->GetType() == EXPR_TYPE_VARIABLE) {
+    const string& Name = static_cast<VariableASTNode*>(Expr)->Name;
+    Key = "var " + Name + " " + str(S.Versions[Name]);
+  } else if (Expr->GetType() == EXPR_TYPE_FUNCALL) {
+    auto *Call = static_cast<CallASTNode*>(Expr);
+    Key = Call->Callee + "(";
+    Effects = Call->Callee == "print" || Call->Callee == "store" || Call->Callee == "load";
+    for (auto& A : Call->Args) {
+      const int ArgId = HashCons(A.get(), S);
+      Key += str(ArgId) + ",";
+      Effects = Effects || S.Effects[ArgId];
+    }
+    Key += ")";
+  } else {
+    // A literal; long array literals print a digest of their values.
+    std::ostringstream Text;
+    Expr->Print(Text);
+    Key = Text.str();
+  }
+
+  const int Id = S.Ids.emplace(Key, S.Ids.size()).first->second;
+  if (Id == (int) S.Count.size()) {
+    S.Count.push_back(0);
+    S.Effects.push_back(Effects);
+  }
+  S.Count[Id]++;
+  S.NodeId[Expr] = Id;
+  return Id;
+}
+
+// Forgets the occurrences of everything below Expr, which is about to be
+// replaced by a variable.
+static void DropOperands(ASTNode* Expr, CSEState& S) {
+  if (Expr->GetType() != EXPR_TYPE_FUNCALL) {
+    return;
+  }
+  for (auto& A : static_cast<CallASTNode*>(Expr)->Args) {
+    S.Count[S.NodeId[A.get()]]--;
+    DropOperands(A.get(), S);
+  }
+}
+
+// Visits the expressions in program order. Only the first occurrence of a
+// repeated expression is computed, so the operands of the others do not
+// count: without this, add(neg(A), B) occurring twice would also hoist
+// neg(A) and split the fused loop computing the sum.
+static void DropRepeatedOperands(ASTNode* Expr, CSEState& S, std::set<int>& Seen) {
+  if (Expr->GetType() != EXPR_TYPE_FUNCALL) {
+    return;
+  }
+  const int Id = S.NodeId[Expr];
+  if (IsShareable(Expr, S) && S.Count[Id] > 1 && !Seen.insert(Id).second) {
+    DropOperands(Expr, S);
+    return;
+  }
+  for (auto& A : static_cast<CallASTNode*>(Expr)->Args) {
+    DropRepeatedOperands(A.get(), S, Seen);
+  }
+}
+
+// Replaces the repeated expressions in Expr by the variables holding them,
+// hoisting their first occurrences into S.Pending.
+static void ShareExpr(unique_ptr<ASTNode>& Expr, CSEState& S) {
+  if (Expr->GetType() != EXPR_TYPE_FUNCALL) {
+    return;
+  }
+  auto *Call = static_cast<CallASTNode*>(Expr.get());
+  const int Id = S.NodeId[Call];
+  if (!IsShareable(Call, S) || S.Count[Id] < 2) {
+    for (auto& A : Call->Args) {
+      ShareExpr(A, S);
+    }
+    return;
+  }
+
+  MiniAPLArrayType type = TypeTable[Call];
+  auto H = S.Hoisted.find(Id);
+  string Name;
+  if (H == S.Hoisted.end()) {
+    for (auto& A : Call->Args) {
+      ShareExpr(A, S);
+    }
+    // Not a name the lexer can produce, so it never clashes with the
+    // program's own variables.
+    Name = "(cse" + str(S.Hoisted.size()) + ")";
+    S.Hoisted[Id] = Name;
+    auto *Assign = new AssignStmtAST(Name, move(Expr));
+    TypeTable[Assign->Name.get()] = type;
+    Environment[Name] = {type, nullptr};
+    S.Pending.emplace_back(Assign);
+  } else {
+    Name = H->second;
+    CountStat("common_subexpressions", 1);
+  }
+  auto *Var = new VariableASTNode(Name);
+  TypeTable[Var] = type;
+  Expr.reset(Var);
+}
+
+void EliminateCommonSubexpressions(ProgramAST& Prog) {
+  CSEState S;
+  for (auto& St : Prog.Stmts) {
+    if (St->IsAssign()) {
+      auto *Assign = static_cast<AssignStmtAST*>(St.get());
+      HashCons(Assign->RHS.get(), S);
+      S.Versions[Assign->GetName()]++;
+    } else {
+      HashCons(static_cast<ExprStmtAST*>(St.get())->Val.get(), S);
+    }
+  }
+
+  std::set<int> Seen;
+  for (auto& St : Prog.Stmts) {
+    DropRepeatedOperands(St->IsAssign() ? static_cast<AssignStmtAST*>(St.get())->RHS.get()
+                                        : static_cast<ExprStmtAST*>(St.get())->Val.get(), S, Seen);
+  }
+
+  vector<unique_ptr<StmtAST>> Stmts;
+  for (auto& St : Prog.Stmts) {
+    ShareExpr(St->IsAssign() ? static_cast<AssignStmtAST*>(St.get())->RHS
+                             : static_cast<ExprStmtAST*>(St.get())->Val, S);
+    for (auto& P : S.Pending) {
+      Stmts.push_back(move(P));
+    }
+    S.Pending.clear();
+    Stmts.push_back(move(St));
+  }
+  Prog.Stmts = move(Stmts);
+}
+
+// ---------------------------------------------------------------------------
+// Elementwise fusion
+// ---------------------------------------------------------------------------
+static void FuseExpr(unique_ptr<ASTNode>& Expr);
+
+// Appends the non-elementwise operands of the elementwise tree rooted at
+// Call to Leaves, fusing inside them along the way.
+static void CollectFusedLeaves(CallASTNode* Call, vector<ASTNode*>& Leaves) {
+  for (int i = 0; i < (int) Call->Args.size(); i++) {
+    auto& A = Call->Args[i];
+    if (i < ElementwiseArrayArgs(Call) && IsElementwiseCall(A.get())) {
+      CollectFusedLeaves(static_cast<CallASTNode*>(A.get()), Leaves);
+    } else {
+      FuseExpr(A);
+      if (i < ElementwiseArrayArgs(Call)) {
+        Leaves.push_back(A.get());
+      }
+    }
+  }
+}
+
+// Replaces every elementwise builtin that has another elementwise builtin as
+// an array operand by a FusedASTNode covering the whole chain.
+static void FuseExpr(unique_ptr<ASTNode>& Expr) {
+  if (Expr->GetType() != EXPR_TYPE_FUNCALL) {
+    return;
+  }
+  auto *Call = static_cast<CallASTNode*>(Expr.get());
+
+  bool IsChain = false;
+  if (IsElementwiseCall(Call)) {
+    for (int i = 0; i < ElementwiseArrayArgs(Call); i++) {
+      IsChain |= IsElementwiseCall(Call->Args[i].get());
+    }
+  }
+  if (!IsChain) {
+    for (auto& A : Call->Args) {
+      FuseExpr(A);
     }
+    return;
   }
 
-  TheModule = llvm::make_unique<Module>("MiniAPL Module " + target_file, TheContext);
+  auto *Fused = new FusedASTNode();
+  TypeTable[Fused] = TypeTable[Call];
+  Fused->Root = move(Expr);
+  CollectFusedLeaves(Call, Fused->Leaves);
+  Expr.reset(Fused);
+}
+
+void FuseElementwise(ProgramAST& Prog) {
+  for (auto& S : Prog.Stmts) {
+    if (S->IsAssign()) {
+      FuseExpr(static_cast<AssignStmtAST*>(S.get())->RHS);
+    } else {
+      FuseExpr(static_cast<ExprStmtAST*>(S.get())->Val);
+    }
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Liveness
+// ---------------------------------------------------------------------------
+
+// Counts the reads of each variable in Expr.
+static void CountReads(ASTNode* Expr, unordered_map<string, int>& Reads) {
+  if (Expr->GetType() == EXPR_TYPE_VARIABLE) {
+    Reads[static_cast<VariableASTNode*>(Expr)->Name]++;
+  } else if (Expr->GetType() == EXPR_TYPE_FUSED) {
+    CountReads(static_cast<FusedASTNode*>(Expr)->Root.get(), Reads);
+  } else if (Expr->GetType() == EXPR_TYPE_FUNCALL) {
+    for (auto& A : static_cast<CallASTNode*>(Expr)->Args) {
+      CountReads(A.get(), Reads);
+    }
+  }
+}
+
+// Fills in Liveness for the statements of Prog: every array a variable is
+// bound to dies at the last statement that reads it before the variable is
+// reassigned, or right away if it is never read.
+void AnalyzeLiveness(ProgramAST& Prog) {
+  Liveness.clear();
+  // For the array each variable is currently bound to, the statement that
+  // last read it and the statement that assigned it.
+  unordered_map<string, StmtAST*> LastRead;
+  map<string, StmtAST*> AssignedBy;
+  auto Retire = [&](const string& Name) {
+    auto R = LastRead.find(Name);
+    if (R != LastRead.end()) {
+      Liveness[R->second].Dying.push_back(Name);
+      LastRead.erase(R);
+    } else {
+      Liveness[AssignedBy[Name]].DeadStore = true;
+    }
+  };
+
+  for (auto& S : Prog.Stmts) {
+    StmtLiveness& L = Liveness[S.get()];
+    if (S->IsAssign()) {
+      CountReads(static_cast<AssignStmtAST*>(S.get())->RHS.get(), L.Reads);
+    } else {
+      CountReads(static_cast<ExprStmtAST*>(S.get())->Val.get(), L.Reads);
+    }
+    for (auto& R : L.Reads) {
+      LastRead[R.first] = S.get();
+    }
+    if (S->IsAssign()) {
+      const string Name = static_cast<AssignStmtAST*>(S.get())->GetName();
+      if (AssignedBy.count(Name)) {
+        Retire(Name);
+      }
+      AssignedBy[Name] = S.get();
+    }
+  }
+  for (auto& A : AssignedBy) {
+    Retire(A.first);
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Object cache keys
+// ---------------------------------------------------------------------------
+
+// Names the object code for a program: an MD5 of the program as the parser
+// and folder left it (so whitespace and folded-away statements do not
+// matter; long literals contribute a digest of their values), the target it
+// is compiled for, the optimization level and the build of this compiler,
+// whose codegen the object also depends on.
+std::string ProgramCacheKey(ProgramAST& Prog, TargetMachine& TM) {
+  std::ostringstream Text;
+  Text << "mini-apl " << __DATE__ << " " << __TIME__ << " llvm " << LLVM_VERSION_STRING << "\n";
+  Text << TM.getTargetTriple().str() << " " << TM.getTargetCPU().str() << " "
+       << TM.getTargetFeatureString().str() << " -O" << OptLevel
+       << (KernelLibrary ? " --kernels" : "") << "\n";
+  for (auto& S : Prog.Stmts) {
+    S->Print(Text);
+    Text << ";\n";
+  }
+
+  MD5 Hash;
+  Hash.update(Text.str());
+  MD5::MD5Result Result;
+  Hash.final(Result);
+  return Result.digest().str();
+}
+
+// ---------------------------------------------------------------------------
+// Ahead-of-time compilation
+// ---------------------------------------------------------------------------
+
+// Name of the function that runs the whole program in AOT-compiled code.
+static const char *AOTEntryName = "miniapl_main";
+// Name of the string constant recording the CPU and features AOT-compiled
+// code was generated for.
+static const char *AOTTargetName = "miniapl_target";
+
+// Generates the program into TheModule as a function named EntryName.
+void CodegenProgram(ProgramAST& Prog, const std::string& EntryName) {
+  // Compute repeated expressions once, collapse chains of elementwise
+  // builtins into single loops, then find where each array dies so that its
+  // buffer can be reused.
+  EliminateCommonSubexpressions(Prog);
+  FuseElementwise(Prog);
+  ResetBuffers();
+  ResetKernels();
+  AnalyzeLiveness(Prog);
+
   std::vector<Type *> Args(0, Type::getDoubleTy(TheContext));
   FunctionType *FT =
     FunctionType::get(Type::getVoidTy(TheContext), Args, false);
 
   Function *F =
-    Function::Create(FT, Function::ExternalLinkage, "__anon_expr", TheModule.get());
+    Function::Create(FT, Function::ExternalLinkage, EntryName, TheModule.get());
   BasicBlock::Create(TheContext, "entry", F);
   Builder.SetInsertPoint(&(F->getEntryBlock()));
 
-  prog.codegen(F);
+  Prog.codegen(F);
 
   Builder.CreateRet(nullptr);
+}
+
+// Writes TheModule to Path as a native object file for TM.
+bool EmitObjectFile(TargetMachine& TM, const std::string& Path) {
+  std::error_code EC;
+  raw_fd_ostream Out(Path, EC, sys::fs::F_None);
+  if (EC) {
+    fprintf(stderr, "Error: could not open %s: %s\n", Path.c_str(), EC.message().c_str());
+    return false;
+  }
+  legacy::PassManager PM;
+  if (TM.addPassesToEmitFile(PM, Out, TargetMachine::CGFT_ObjectFile)) {
+    fprintf(stderr, "Error: the target cannot emit object files\n");
+    return false;
+  }
+  PM.run(*TheModule);
+  Out.flush();
+  return true;
+}
+
+// Links the object at ObjPath with the runtime library installed next to
+// the mini-apl executable into the shared library SoPath, using the C++
+// compiler named by $CXX (c++ by default) as the linker driver.
+bool LinkSharedLibrary(const std::string& ObjPath, const std::string& SoPath, const char* Argv0) {
+  SmallString<128> Runtime(sys::path::parent_path(
+      sys::fs::getMainExecutable(Argv0, (void*) &LinkSharedLibrary)));
+  sys::path::append(Runtime, "libminiapl_runtime.a");
+
+  const char *CxxEnv = getenv("CXX");
+  auto Cxx = sys::findProgramByName(CxxEnv ? CxxEnv : "c++");
+  if (!Cxx) {
+    fprintf(stderr, "Error: no C++ compiler found to link %s\n", SoPath.c_str());
+    return false;
+  }
+  const char *Args[] = {Cxx->c_str(), "-shared", "-pthread", "-o", SoPath.c_str(),
+    ObjPath.c_str(), Runtime.c_str(), nullptr};
+  std::string ErrMsg;
+  if (sys::ExecuteAndWait(*Cxx, Args, nullptr, {}, 0, 0, &ErrMsg) != 0) {
+    fprintf(stderr, "Error: linking %s failed %s\n", SoPath.c_str(), ErrMsg.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Compiles the program ahead of time into an object file (or, with
+// SharedLibrary, a shared library including the runtime) whose exported
+// miniapl_main() runs it. Code is position independent. Unlike the JIT's, it
+// is meant to run on other machines, so it is generated for the CPU named by
+// CPU ("generic" by default, "native" for the host CPU with all of its
+// features) plus the comma separated Features, such as "+avx2,+fma".
+int CompileAheadOfTime(ProgramAST& Prog, const std::string& OutPath, const bool SharedLibrary,
+    const std::string& CPU, const std::string& Features, const char* Argv0) {
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  const bool Native = CPU == "native";
+  vector<std::string> Attrs;
+  if (Native) {
+    Attrs = MiniAPLJIT::hostCPUFeatures();
+  }
+  std::istringstream FeatureList(Features);
+  for (std::string F; std::getline(FeatureList, F, ',');) {
+    if (!F.empty()) {
+      Attrs.push_back(F);
+    }
+  }
+  std::unique_ptr<TargetMachine> TM(EngineBuilder()
+      .setMCPU(Native ? sys::getHostCPUName() : StringRef(CPU))
+      .setMAttrs(Attrs)
+      .setRelocationModel(Reloc::PIC_)
+      .selectTarget());
+
+  TheModule = llvm::make_unique<Module>(AOTEntryName, TheContext);
+  InitializeModuleAndPassManager(*TM);
+  std::string Target = TM->getTargetCPU().str() + " " + TM->getTargetFeatureString().str();
+  Constant *TargetText = ConstantDataArray::getString(TheContext, Target);
+  new GlobalVariable(*TheModule, TargetText->getType(), true, GlobalValue::ExternalLinkage,
+      TargetText, AOTTargetName);
+  EndPhase("target_setup");
+  CodegenProgram(Prog, AOTEntryName);
+  CountStat("ir_instructions", CountInstructions(*TheModule));
+  if (DumpIR) {
+    TheModule->print(errs(), nullptr);
+  }
+  EndPhase("ir_generation");
+  OptimizeModule();
+  CountStat("optimized_ir_instructions", CountInstructions(*TheModule));
+  EndPhase("optimization");
+
+  if (!SharedLibrary) {
+    bool Ok = EmitObjectFile(*TM, OutPath);
+    EndPhase("object_emission");
+    return Ok ? 0 : 1;
+  }
+  SmallString<128> ObjPath;
+  if (sys::fs::createTemporaryFile("miniapl", "o", ObjPath)) {
+    fprintf(stderr, "Error: could not create a temporary object file\n");
+    return 1;
+  }
+  bool Ok = EmitObjectFile(*TM, ObjPath.str());
+  EndPhase("object_emission");
+  Ok = Ok && LinkSharedLibrary(ObjPath.str(), OutPath, Argv0);
+  EndPhase("link");
+  sys::fs::remove(ObjPath);
+  return Ok ? 0 : 1;
+}
+
+// Makes the runtime entry points visible to JIT-compiled code.
+static void RegisterRuntimeSymbols() {
+  sys::DynamicLibrary::AddSymbol("miniapl_arena_alloc", (void*) &miniapl_arena_alloc);
+  sys::DynamicLibrary::AddSymbol("miniapl_print_array", (void*) &miniapl_print_array);
+  sys::DynamicLibrary::AddSymbol("miniapl_print_typed_array", (void*) &miniapl_print_typed_array);
+  sys::DynamicLibrary::AddSymbol("miniapl_parallel_for", (void*) &miniapl_parallel_for);
+  sys::DynamicLibrary::AddSymbol("miniapl_load_array", (void*) &miniapl_load_array);
+  sys::DynamicLibrary::AddSymbol("miniapl_store_array", (void*) &miniapl_store_array);
+}
+
+// ---------------------------------------------------------------------------
+// REPL
+//
+// With --repl, statements are read from stdin and each one runs as soon as
+// its ";" arrives. Every statement is compiled into a module of its own,
+// added to the JIT next to the earlier ones. The host copies each assigned
+// array out of the runtime arena into a buffer of its own and then releases
+// the arena, so a statement's temporaries are freed as soon as it finishes.
+// When a name is rebound, its old buffer is kept for the next array of the
+// same size. A statement's function receives the buffers of the
+// variables it reads as arguments, so its code depends only on its text
+// and their shapes, and entering the same statement again reuses it.
+// ---------------------------------------------------------------------------
+
+// Takes the buffers of the variables a statement reads, in order of first
+// use, and returns the array the statement computes (or nullptr). Buffers
+// of every element type are passed as int32_t*.
+typedef int32_t *(*StmtFunction)(int32_t **);
+
+// A buffer of the host holding the array a variable is bound to.
+struct ReplArray {
+  int32_t *Data;
+  int64_t Bytes;
+};
+
+// Array each variable of the session is currently bound to.
+static unordered_map<string, ReplArray> ReplBuffers;
+// Buffers no variable is bound to any more, by size in bytes.
+static unordered_map<int64_t, vector<int32_t*>> ReplFreeBuffers;
+// Compiled statements, by statement text and the shapes of its inputs.
+static unordered_map<string, StmtFunction> ReplFunctions;
+
+// Appends the variables read by Expr to Names, each once.
+static void CollectVariables(ASTNode* Expr, vector<string>& Names) {
+  if (Expr->GetType() == EXPR_TYPE_VARIABLE) {
+    const string& Name = static_cast<VariableASTNode*>(Expr)->Name;
+    if (std::find(Names.begin(), Names.end(), Name) == Names.end()) {
+      Names.push_back(Name);
+    }
+  } else if (Expr->GetType() == EXPR_TYPE_FUNCALL) {
+    for (auto& A : static_cast<CallASTNode*>(Expr)->Args) {
+      CollectVariables(A.get(), Names);
+    }
+  }
+}
+
+// Compiles the single statement of Prog into a module of its own as a
+// StmtFunction named Name, reading the variables Inputs, whose element types
+// are InputElems.
+StmtFunction CompileStatement(ProgramAST& Prog, const vector<string>& Inputs,
+    const vector<ElemType>& InputElems, const string& Name) {
+  TheModule = llvm::make_unique<Module>(Name, TheContext);
+  InitializeModuleAndPassManager(TheJIT->getTargetMachine());
+  FuseElementwise(Prog);
+  ResetBuffers();
+  ResetKernels();
+
+  FunctionType *FT = FunctionType::get(arrayPtrTy(),
+      {PointerType::get(arrayPtrTy(), 0)}, false);
+  Function *F = Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
+  BasicBlock::Create(TheContext, "entry", F);
+  Builder.SetInsertPoint(&(F->getEntryBlock()));
+
+  Value *InputBuffers = &*F->arg_begin();
+  for (int i = 0; i < (int) Inputs.size(); i++) {
+    Value *Buffer = Builder.CreateLoad(arrayPtrTy(),
+        Builder.CreateGEP(arrayPtrTy(), InputBuffers, indexConst(i)));
+    Binding& B = Environment[Inputs[i]];
+    B.Val = Builder.CreateBitCast(Buffer, arrayPtrTy(InputElems[i]));
+    B.Val2 = nullptr;
+    B.Type.layout = ArrayLayout();
+  }
+
+  Value *Result = Prog.Stmts[0]->codegen(F);
+  if (Prog.Stmts[0]->IsAssign()) {
+    // Variables live on between statements as contiguous buffers.
+    auto *Assign = static_cast<AssignStmtAST*>(Prog.Stmts[0].get());
+    Result = Assign->Name->codegen(F);
+    Binding& B = Environment[Assign->GetName()];
+    B.Val = Result;
+    B.Val2 = nullptr;
+    B.Type.layout = ArrayLayout();
+  }
+  if (Result && !Result->getType()->isPointerTy()) {
+    // A scalar; variables are always bound to buffers.
+    Value *Boxed = allocArray(1, Result->getType());
+    Builder.CreateStore(Result, Boxed);
+    Result = Boxed;
+  }
+  Builder.CreateRet(Result ? Builder.CreateBitCast(Result, arrayPtrTy())
+                           : ConstantPointerNull::get(arrayPtrTy()));
+  CountStat("ir_instructions", CountInstructions(*TheModule));
+  if (DumpIR) {
+    TheModule->print(errs(), nullptr);
+  }
+  EndPhase("ir_generation");
+
+  OptimizeModule();
+  CountStat("optimized_ir_instructions", CountInstructions(*TheModule));
+  EndPhase("optimization");
+  TheJIT->addModule(std::move(TheModule));
+  auto Fn = (StmtFunction)(intptr_t)cantFail(TheJIT->findSymbol(Name).getAddress());
+  CommitKernels();
+  EndPhase("jit_compilation");
+  return Fn;
+}
+
+// Binds Name to a copy of the Bytes bytes at Data, in a buffer that an
+// earlier rebinding freed if there is one of that size. Buffers are 64-byte
+// aligned, like arena memory.
+static void BindReplArray(const string& Name, const int32_t* Data, const int64_t Bytes) {
+  int32_t *Copy;
+  vector<int32_t*>& Free = ReplFreeBuffers[Bytes];
+  if (!Free.empty()) {
+    Copy = Free.back();
+    Free.pop_back();
+  } else {
+    Copy = static_cast<int32_t*>(aligned_alloc(64, (std::max(Bytes, (int64_t) 1) + 63) / 64 * 64));
+    if (!Copy) {
+      fprintf(stderr, "Error: could not allocate %lld bytes for %s\n", (long long) Bytes, Name.c_str());
+      exit(1);
+    }
+  }
+  memcpy(Copy, Data, Bytes);
+
+  auto Old = ReplBuffers.find(Name);
+  if (Old != ReplBuffers.end()) {
+    ReplFreeBuffers[Old->second.Bytes].push_back(Old->second.Data);
+  }
+  ReplBuffers[Name] = {Copy, Bytes};
+}
+
+// Parses, compiles (unless an identical statement was compiled before) and
+// runs one statement, given without its ";".
+void RunReplStatement(StringRef Text) {
+  StartPhase();
+  ParseState PS(Text);
+  if (PS.AtEnd()) {
+    return;
+  }
+  unique_ptr<StmtAST> S = ParseStmt(PS);
+  if (!S) {
+    return;
+  }
+  if (!PS.AtEnd()) {
+    LogError("expected ';' after a statement");
+    return;
+  }
+  EndPhase("parse");
+
+  ASTNode *Expr = S->IsAssign() ? static_cast<AssignStmtAST*>(S.get())->RHS.get()
+                                : static_cast<ExprStmtAST*>(S.get())->Val.get();
+  vector<string> Inputs;
+  CollectVariables(Expr, Inputs);
+  vector<int32_t*> Buffers;
+  for (auto& Name : Inputs) {
+    auto B = ReplBuffers.find(Name);
+    if (B == ReplBuffers.end()) {
+      fprintf(stderr, "Error: unknown variable %s\n", Name.c_str());
+      return;
+    }
+    Buffers.push_back(B->second.Data);
+  }
+
+  // The statement is printed after type checking, which spells out the
+  // shapes of loads.
+  std::ostringstream Key;
+  vector<ElemType> InputElems;
+  for (auto& Name : Inputs) {
+    Key << Environment[Name].Type << " ";
+    InputElems.push_back(Environment[Name].Type.elem);
+  }
+  TypeCheckStatement(S.get());
+  EndPhase("type_check");
+  S->Print(Key);
+
+  string Assigned = S->IsAssign() ? static_cast<AssignStmtAST*>(S.get())->GetName() : "";
+  StmtFunction& Fn = ReplFunctions[Key.str()];
+  if (!Fn) {
+    ProgramAST Prog;
+    Prog.Stmts.push_back(move(S));
+    Fn = CompileStatement(Prog, Inputs, InputElems, "stmt" + str(ReplFunctions.size()));
+  }
 
-  // NOTE: You may want to uncomment this line to see the LLVM IR you have generated
-  TheModule->print(errs(), nullptr);
+  int32_t *Result = Fn(Buffers.data());
+  if (Assigned != "") {
+    MiniAPLArrayType& T = Environment[Assigned].Type;
+    BindReplArray(Assigned, Result, T.Cardinality() * miniapl_elem_bytes(T.elem));
+  }
+  // Everything else the statement allocated was a temporary.
+  miniapl_arena_release();
+  EndPhase("execution");
+  CountStat("statements", 1);
+}
+
+// Offset of the ";" that ends the first statement in Text, or StringRef::npos
+// if it has not been read completely. A ";" in a string literal ends nothing.
+static size_t StatementEnd(StringRef Text) {
+  Lexer Lex(Text);
+  for (Token T = Lex.next(); T.Kind != TOK_EOF; T = Lex.next()) {
+    if (T.Kind == TOK_PUNCT && T.Text[0] == ';') {
+      return T.Text.begin() - Text.begin();
+    }
+  }
+  return StringRef::npos;
+}
 
-  // Initialize the JIT, compile the module to a function,
-  // find the function and then run it.
+// Runs the statements on stdin one at a time until it is closed.
+int RunRepl() {
   InitializeNativeTarget();
   InitializeNativeTargetAsmPrinter();
   InitializeNativeTargetAsmParser();
   TheJIT = llvm::make_unique<MiniAPLJIT>();
-  InitializeModuleAndPassManager();
-  auto H = TheJIT->addModule(std::move(TheModule));
+  RegisterRuntimeSymbols();
+  ShareKernels = true;
+  EndPhase("jit_setup");
+
+  string Pending;
+  string Line;
+  while (std::getline(std::cin, Line)) {
+    Pending += Line;
+    Pending += '\n';
+    if (Line.find(';') == string::npos) {
+      continue;
+    }
+    size_t End;
+    while ((End = StatementEnd(Pending)) != StringRef::npos) {
+      RunReplStatement(StringRef(Pending.data(), End));
+      Pending.erase(0, End + 1);
+    }
+  }
+  RunReplStatement(Pending);
 
+  for (auto& B : ReplBuffers) {
+    free(B.second.Data);
+  }
+  for (auto& Free : ReplFreeBuffers) {
+    for (auto *Data : Free.second) {
+      free(Data);
+    }
+  }
+  return 0;
+}
+
+int main(const int argc, const char** argv) {
+  string target_file = "";
+  ExecutionTier Tier = TIER_AUTO;
+  const char *CacheEnv = getenv("MINIAPL_CACHE_DIR");
+  string CacheDir = CacheEnv ? CacheEnv : "";
+  string EmitPath = "";
+  bool EmitSharedLibrary = false;
+  string TargetCPU = "generic";
+  string TargetFeatures = "";
+  bool Repl = false;
+  for (int i = 1; i < argc; i++) {
+    string Arg = argv[i];
+    if (Arg == "--huge-pages") {
+      miniapl_arena_use_huge_pages(1);
+    } else if (Arg == "--threads" && i + 1 < argc) {
+      miniapl_set_threads(atoi(argv[++i]));
+    } else if (Arg == "--repl") {
+      Repl = true;
+    } else if (Arg == "--stats" || Arg == "--stats=text") {
+      StatsOutput = STATS_TEXT;
+    } else if (Arg == "--stats=json") {
+      StatsOutput = STATS_JSON;
+    } else if (Arg == "--dump-ir") {
+      DumpIR = true;
+    } else if (Arg == "--kernels") {
+      KernelLibrary = true;
+    } else if (Arg == "--interp") {
+      Tier = TIER_INTERPRETER;
+    } else if (Arg == "--jit") {
+      Tier = TIER_JIT;
+    } else if (Arg == "--fold-limit" && i + 1 < argc) {
+      FoldLimit = atoi(argv[++i]);
+    } else if ((Arg == "--emit-obj" || Arg == "--emit-so") && i + 1 < argc) {
+      EmitPath = argv[++i];
+      EmitSharedLibrary = Arg == "--emit-so";
+    } else if (Arg == "--mcpu" && i + 1 < argc) {
+      TargetCPU = argv[++i];
+    } else if (Arg == "--mattr" && i + 1 < argc) {
+      TargetFeatures = argv[++i];
+    } else if (Arg == "--cache-dir" && i + 1 < argc) {
+      CacheDir = argv[++i];
+    } else if (Arg.size() == 3 && Arg[0] == '-' && Arg[1] == 'O' && Arg[2] >= '0' && Arg[2] <= '3') {
+      OptLevel = Arg[2] - '0';
+    } else {
+      target_file = Arg;
+    }
+  }
+  if (StatsOutput != STATS_NONE) {
+    // Report on every way out of the program, including errors.
+    atexit(ReportStats);
+  }
+  if (Repl) {
+    return RunRepl();
+  }
+  if (target_file == "") {
+    fprintf(stderr, "Usage: mini-apl [-O0|-O1|-O2|-O3] [--interp|--jit] [--fold-limit N] [--threads N] [--cache-dir DIR] [--emit-obj FILE|--emit-so FILE [--mcpu CPU] [--mattr FEATURES]] [--huge-pages] [--kernels] [--stats[=json]] [--dump-ir] <program.mapl>\n"
+                    "       mini-apl [-O0|-O1|-O2|-O3] [--threads N] [--huge-pages] [--kernels] [--stats[=json]] [--dump-ir] --repl\n");
+    return 1;
+  }
+
+  // Map the source file into memory; the lexer reads it in place.
+  StartPhase();
+  auto Source = MemoryBuffer::getFile(target_file);
+  if (!Source) {
+    fprintf(stderr, "Error: could not read %s\n", target_file.c_str());
+    return 1;
+  }
+  EndPhase("read");
+
+  // Parse the statements into a program. The lexer runs on demand from
+  // the parser, so lexing is timed as part of parsing.
+  ProgramAST prog;
+  if (!ParseProgram((*Source)->getBuffer(), prog)) {
+    return 1;
+  }
+  EndPhase("lex_and_parse");
+  CountStat("statements", prog.Stmts.size());
+
+  // Infer types
+  for (auto& S : prog.Stmts) {
+    TypeCheckStatement(S.get());
+  }
+  EndPhase("type_check");
+
+  // Ahead-of-time compilation always generates code, so the tiers below
+  // that avoid it do not apply.
+  if (EmitPath != "") {
+    Tier = TIER_JIT;
+  }
+
+  // Evaluate whatever is known at compile time. If that is the whole
+  // program, print its results directly and skip LLVM altogether.
+  vector<FoldedOutput> Outputs;
+  bool Folded = FoldConstants(prog, Outputs);
+  EndPhase("constant_folding");
+  if (Folded && Tier != TIER_JIT) {
+    for (auto& O : Outputs) {
+      PrintArrayData(O.Data, O.Dims);
+    }
+    EndPhase("execution");
+    return 0;
+  }
+
+  // Run small programs on the interpreter instead of starting the JIT.
+  if (CanInterpret(prog) &&
+      (Tier == TIER_INTERPRETER || (Tier == TIER_AUTO && PreferInterpreter(prog)))) {
+    InterpretProgram(prog);
+    EndPhase("interpretation");
+    return 0;
+  }
+
+  if (EmitPath != "") {
+    return CompileAheadOfTime(prog, EmitPath, EmitSharedLibrary, TargetCPU, TargetFeatures, argv[0]);
+  }
+
+  // Start the JIT first: the object cache key depends on its target.
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  InitializeNativeTargetAsmParser();
+  std::unique_ptr<MiniAPLObjectCache> Cache;
+  if (CacheDir != "") {
+    Cache = llvm::make_unique<MiniAPLObjectCache>(CacheDir);
+  }
+  TheJIT = llvm::make_unique<MiniAPLJIT>(Cache.get());
+  RegisterRuntimeSymbols();
+  EndPhase("jit_setup");
+
+  // With a cache, the module is named by its key. If the object is already
+  // cached, the module is left empty: the JIT loads the object instead of
+  // compiling, so generating IR would be wasted work.
+  string ModuleName = "MiniAPL Module " + target_file;
+  bool Cached = false;
+  if (Cache) {
+    ModuleName = ProgramCacheKey(prog, TheJIT->getTargetMachine());
+    Cached = Cache->prefetch(ModuleName);
+    CountStat("object_cache_hits", Cached);
+    EndPhase("object_cache_lookup");
+  }
+  TheModule = llvm::make_unique<Module>(ModuleName, TheContext);
+  InitializeModuleAndPassManager(TheJIT->getTargetMachine());
+
+  if (!Cached) {
+    CodegenProgram(prog, "__anon_expr");
+    CountStat("ir_instructions", CountInstructions(*TheModule));
+
+    // The IR before optimization, with --dump-ir.
+    if (DumpIR) {
+      TheModule->print(errs(), nullptr);
+    }
+    EndPhase("ir_generation");
+
+    OptimizeModule();
+    CountStat("optimized_ir_instructions", CountInstructions(*TheModule));
+    EndPhase("optimization");
+  }
+
+  // Compile the module (or load its cached object), find the function and
+  // then run it.
+  auto H = TheJIT->addModule(std::move(TheModule));
 
   auto ExprSymbol = TheJIT->findSymbol("__anon_expr");
   void (*FP)() = (void (*)())(intptr_t)cantFail(ExprSymbol.getAddress());
   assert(FP != nullptr);
+  EndPhase("jit_compilation");
   FP();
+  EndPhase("execution");
+
+  // Arrays are only reachable from the program, so free them all at once.
+  miniapl_arena_release();
 
   TheJIT->removeModule(H);
 
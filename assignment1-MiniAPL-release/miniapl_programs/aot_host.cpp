@@ -0,0 +1,11 @@
+// Host program for the ahead-of-time compilation test (make aot-test): runs
+// a MiniAPL program compiled with --emit-obj or --emit-so.
+#include "../MiniAPLRuntime.h"
+
+extern "C" void miniapl_main();
+
+int main() {
+  miniapl_main();
+  miniapl_arena_release();
+  return 0;
+}